@@ -1,13 +1,27 @@
 #include <iostream>
+#include <fstream>
 #include <exception>
 #include <map>
 #include<array>
 #include <cmath>
+#include <cstdint>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <algorithm>
 
 using namespace std;
 
 enum class Color {B, W};
 enum class Piece {K, Q, R, H, B, P};
+enum class Draw {None, Stalemate, Repetition, FiftyMoves, InsufficientMaterial};
 
 class Position {
     int row, column;
@@ -22,6 +36,9 @@ class Position {
     int getColumn() {
       return column;
     }
+    int getSquare() {
+      return row * 8 + column;
+    }
 };
 class Board;
 
@@ -49,12 +66,357 @@ class Result {
     bool check;
     bool checkmate;
     bool canMove;
-    Result(bool promotion, bool check, bool checkmate, bool canMove) {
+    Draw draw;
+    Result(bool promotion, bool check, bool checkmate, bool canMove, Draw draw = Draw::None) {
       this->promotion = promotion;
       this->check = check;
       this->checkmate = checkmate;
       this->canMove = canMove;
+      this->draw = draw;
+    }
+};
+
+class Move {
+    Position from;
+    Position to;
+  public:
+    Move(Position from, Position to) : from(from), to(to) {
+    }
+    Position getFrom() {
+      return from;
+    }
+    Position getTo() {
+      return to;
+    }
+};
+
+/*
+ * Instrumentation of the hot paths, compiled in with -DCHESS_INSTRUMENT
+ * and reduced to nothing without it. Every thread counts calls and
+ * records latencies in its own counters, so the hot paths never share a
+ * cache line; Instrumentation::dumpJson merges the counters of all the
+ * threads, including the finished ones.
+ * The benchmark times the same operations. The calculators follow the
+ * order of Piece.
+ */
+enum class Operation {Move, CanMove, IsCurrentInCheck, IsCurrentInCheckmate, CanExecuteSmallCastle, CanExecuteBigCastle,
+  KingMoveCalculator, QueenMoveCalculator, RookMoveCalculator, HorseMoveCalculator, BishopMoveCalculator, PawnMoveCalculator, Count};
+
+const char* operationNames[] = {"move", "canMove", "isCurrentInCheck", "isCurrentInCheckmate", "canExecuteSmallCastle", "canExecuteBigCastle",
+  "KingMoveCalculator", "QueenMoveCalculator", "RookMoveCalculator", "HorseMoveCalculator", "BishopMoveCalculator", "PawnMoveCalculator"};
+
+const int operationCount = static_cast<int>(Operation::Count);
+
+#ifdef CHESS_INSTRUMENT
+
+/*
+ * Log-linear latency buckets in nanoseconds, as in HDR histograms:
+ * values below 16 get a bucket each, larger ones keep their top 5
+ * significant bits, which bounds the error of a bucket to 1/16 of its
+ * value. Latencies of 2^48 ns and more share the last bucket.
+ */
+class LatencyBuckets {
+  public:
+    static const int subBuckets = 16;
+    static const int maxExponent = 47;
+    static const int count = (maxExponent - 3) * subBuckets + subBuckets;
+
+    static int bucket(uint64_t ns) {
+      if (ns < subBuckets) {
+        return static_cast<int>(ns);
+      }
+      int e = 63 - __builtin_clzll(ns);
+      if (e > maxExponent) {
+        return count - 1;
+      }
+      return (e - 3) * subBuckets + static_cast<int>((ns >> (e - 4)) & (subBuckets - 1));
+    }
+
+    /*
+     * Smallest latency falling in bucket b.
+     */
+    static uint64_t lowest(int b) {
+      if (b < subBuckets) {
+        return b;
+      }
+      int e = b / subBuckets + 3;
+      return static_cast<uint64_t>(subBuckets + b % subBuckets) << (e - 4);
+    }
+};
+
+/*
+ * Counters of one thread. Only the owning thread writes them, so relaxed
+ * loads and stores suffice and dumpJson can read them at any time.
+ */
+class ThreadCounters {
+  public:
+    atomic<uint64_t> calls[operationCount];
+    atomic<uint64_t> totalNs[operationCount];
+    atomic<uint64_t> maxNs[operationCount];
+    atomic<uint64_t> histogram[operationCount][LatencyBuckets::count];
+
+    ThreadCounters() {
+      for (int o = 0; o < operationCount; o++) {
+        calls[o].store(0, memory_order_relaxed);
+        totalNs[o].store(0, memory_order_relaxed);
+        maxNs[o].store(0, memory_order_relaxed);
+        for (int b = 0; b < LatencyBuckets::count; b++) {
+          histogram[o][b].store(0, memory_order_relaxed);
+        }
+      }
+    }
+
+    void record(Operation op, uint64_t ns) {
+      int o = static_cast<int>(op);
+      atomic<uint64_t>& bucket = histogram[o][LatencyBuckets::bucket(ns)];
+      calls[o].store(calls[o].load(memory_order_relaxed) + 1, memory_order_relaxed);
+      totalNs[o].store(totalNs[o].load(memory_order_relaxed) + ns, memory_order_relaxed);
+      bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+      if (ns > maxNs[o].load(memory_order_relaxed)) {
+        maxNs[o].store(ns, memory_order_relaxed);
+      }
+    }
+};
+
+class Instrumentation {
+    static mutex& registryMutex() {
+      static mutex m;
+      return m;
+    }
+
+    /*
+     * The counters of every thread that ever recorded. They are never
+     * freed, so the calls of finished threads still show in the dump.
+     */
+    static vector<ThreadCounters*>& registry() {
+      static vector<ThreadCounters*> r;
+      return r;
+    }
+
+    static uint64_t percentile(const vector<uint64_t>& histogram, uint64_t calls, double p) {
+      uint64_t rank = static_cast<uint64_t>(ceil(p * calls));
+      uint64_t seen = 0;
+      for (int b = 0; b < LatencyBuckets::count; b++) {
+        seen += histogram[b];
+        if (seen >= rank && seen > 0) {
+          return LatencyBuckets::lowest(b);
+        }
+      }
+      return 0;
+    }
+
+  public:
+    static ThreadCounters& local() {
+      thread_local ThreadCounters* counters = nullptr;
+      if (counters == nullptr) {
+        counters = new ThreadCounters;
+        lock_guard<mutex> lock(registryMutex());
+        registry().push_back(counters);
+      }
+      return *counters;
+    }
+
+    /*
+     * Writes, per operation, the calls, the total and mean time and the
+     * latency percentiles of all the threads, times in nanoseconds.
+     */
+    static void dumpJson(ostream& out) {
+      lock_guard<mutex> lock(registryMutex());
+      out << "{\"threads\": " << registry().size() << ", \"operations\": {";
+      for (int o = 0; o < operationCount; o++) {
+        uint64_t calls = 0, total = 0, max = 0;
+        vector<uint64_t> histogram(LatencyBuckets::count, 0);
+        for (ThreadCounters* tc : registry()) {
+          calls += tc->calls[o].load(memory_order_relaxed);
+          total += tc->totalNs[o].load(memory_order_relaxed);
+          max = std::max(max, tc->maxNs[o].load(memory_order_relaxed));
+          for (int b = 0; b < LatencyBuckets::count; b++) {
+            histogram[b] += tc->histogram[o][b].load(memory_order_relaxed);
+          }
+        }
+        out << (o == 0 ? "" : ", ") << '"' << operationNames[o] << "\": {\"calls\": " << calls << ", \"totalNs\": " << total
+            << ", \"meanNs\": " << (calls == 0 ? 0 : total / calls) << ", \"p50Ns\": " << percentile(histogram, calls, 0.5)
+            << ", \"p90Ns\": " << percentile(histogram, calls, 0.9) << ", \"p99Ns\": " << percentile(histogram, calls, 0.99)
+            << ", \"p999Ns\": " << percentile(histogram, calls, 0.999) << ", \"maxNs\": " << max << '}';
+      }
+      out << "}}" << '\n';
+    }
+};
+
+/*
+ * Times the rest of the enclosing scope.
+ */
+class ScopedTimer {
+    Operation op;
+    chrono::steady_clock::time_point start;
+  public:
+    ScopedTimer(Operation op) : op(op), start(chrono::steady_clock::now()) {
+    }
+    ~ScopedTimer() {
+      uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+      Instrumentation::local().record(op, ns);
+    }
+};
+
+#define INSTRUMENT(op) ScopedTimer scopedTimer(op)
+#else
+#define INSTRUMENT(op)
+#endif
+
+/*
+ * Squares are also addressed as bits of a 64 bit mask, bit row * 8 + column.
+ * directions holds the four orthogonal steps followed by the four diagonal
+ * ones, which are also the steps of the king. directions[d ^ 1] is the
+ * opposite of directions[d].
+ */
+constexpr int directions[8][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-1, -1}, {1, 1}, {-1, 1}, {1, -1}};
+constexpr int horseMoves[8][2] = {{1, 2}, {2, 1}, {-1, 2}, {2, -1}, {-2, 1}, {1, -2}, {-2, -1}, {-1, -2}};
+
+/*
+ * Attack sets of the pieces, built by the compiler so a lookup costs a
+ * single load and nothing is computed at startup:
+ * - horse[s], king[s]: squares a knight or a king on s attacks.
+ * - pawn[color][s]: squares a pawn of that color on s captures on.
+ * - ray[d][s]: squares from s to the edge along directions[d].
+ * - rook[s], bishop[s]: the union of the orthogonal or diagonal rays.
+ * - between[a][b]: squares strictly between a and b.
+ * - line[a][b]: the whole line through a and b, edge to edge.
+ * between and line are empty when a and b share no row, column or diagonal.
+ */
+class SquareTables {
+  public:
+    uint64_t horse[64] = {};
+    uint64_t king[64] = {};
+    uint64_t pawn[2][64] = {};
+    uint64_t ray[8][64] = {};
+    uint64_t rook[64] = {};
+    uint64_t bishop[64] = {};
+    uint64_t between[64][64] = {};
+    uint64_t line[64][64] = {};
+};
+
+constexpr bool onBoard(int row, int column) {
+  return row >= 0 && row < 8 && column >= 0 && column < 8;
+}
+
+constexpr SquareTables makeSquareTables() {
+  SquareTables t;
+  for (int s = 0; s < 64; s++) {
+    int row = s / 8;
+    int column = s % 8;
+    for (int m = 0; m < 8; m++) {
+      if (onBoard(row + horseMoves[m][0], column + horseMoves[m][1])) {
+        t.horse[s] |= 1ULL << (s + horseMoves[m][0] * 8 + horseMoves[m][1]);
+      }
+      if (onBoard(row + directions[m][0], column + directions[m][1])) {
+        t.king[s] |= 1ULL << (s + directions[m][0] * 8 + directions[m][1]);
+      }
+    }
+    for (int c = column - 1; c <= column + 1; c += 2) {
+      if (onBoard(row - 1, c)) {
+        t.pawn[static_cast<int>(Color::W)][s] |= 1ULL << ((row - 1) * 8 + c);
+      }
+      if (onBoard(row + 1, c)) {
+        t.pawn[static_cast<int>(Color::B)][s] |= 1ULL << ((row + 1) * 8 + c);
+      }
+    }
+    for (int d = 0; d < 8; d++) {
+      int dr = directions[d][0];
+      int dc = directions[d][1];
+      for (int r = row + dr, c = column + dc; onBoard(r, c); r += dr, c += dc) {
+        t.ray[d][s] |= 1ULL << (r * 8 + c);
+      }
+    }
+  }
+  for (int s = 0; s < 64; s++) {
+    for (int d = 0; d < 8; d++) {
+      if (d < 4) {
+        t.rook[s] |= t.ray[d][s];
+      } else {
+        t.bishop[s] |= t.ray[d][s];
+      }
+      uint64_t full = (1ULL << s) | t.ray[d][s] | t.ray[d ^ 1][s];
+      uint64_t path = 0;
+      for (int r = s / 8 + directions[d][0], c = s % 8 + directions[d][1]; onBoard(r, c); r += directions[d][0], c += directions[d][1]) {
+        t.between[s][r * 8 + c] = path;
+        t.line[s][r * 8 + c] = full;
+        path |= 1ULL << (r * 8 + c);
+      }
+    }
+  }
+  return t;
+}
+
+constexpr SquareTables squareTables = makeSquareTables();
+
+/*
+ * First square of occupancy met from s along directions[d], -1 when
+ * there is none. The odd directions step to higher squares, so their
+ * nearest square is the lowest bit and the others' the highest.
+ */
+int firstBlocker(int d, int s, uint64_t occupancy) {
+  uint64_t blockers = squareTables.ray[d][s] & occupancy;
+  if (blockers == 0) {
+    return -1;
+  }
+  return d % 2 == 1 ? __builtin_ctzll(blockers) : 63 - __builtin_clzll(blockers);
+}
+
+/*
+ * Random keys hashing a position: one per piece, color and square, one
+ * per combination of the four castling rights, one per en passant column
+ * and one for black to move. Generated by the compiler with splitmix64.
+ */
+class ZobristKeys {
+  public:
+    uint64_t piece[2][6][64] = {};
+    uint64_t castle[16] = {};
+    uint64_t enPassant[8] = {};
+    uint64_t black = 0;
+};
+
+constexpr uint64_t splitMix64(uint64_t& state) {
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+constexpr ZobristKeys makeZobristKeys() {
+  ZobristKeys k;
+  uint64_t state = 0x3243F6A8885A308DULL;
+  for (int c = 0; c < 2; c++) {
+    for (int p = 0; p < 6; p++) {
+      for (int s = 0; s < 64; s++) {
+        k.piece[c][p][s] = splitMix64(state);
+      }
     }
+  }
+  for (int i = 0; i < 16; i++) {
+    k.castle[i] = splitMix64(state);
+  }
+  for (int i = 0; i < 8; i++) {
+    k.enPassant[i] = splitMix64(state);
+  }
+  k.black = splitMix64(state);
+  return k;
+}
+
+constexpr ZobristKeys zobristKeys = makeZobristKeys();
+
+/*
+ * What the legality of a move depends on, computed once per position:
+ * the pieces giving check, the squares a non-king move has to land on
+ * to answer the check (every square when not in check, none in double
+ * check) and, for each pinned piece, the line it is allowed to move along.
+ */
+class CheckInfo {
+  public:
+    Position king = Position(-1, -1);
+    uint64_t checkers = 0;
+    uint64_t checkMask = 0;
+    uint64_t pinned = 0;
+    uint64_t pinLine[64];
 };
 
 class MoveCalculator {
@@ -95,6 +457,736 @@ class BPiece {
 
 };
 
+/*
+ * What Board::undo() needs to take a move back: the squares the moved
+ * piece and, when castling, the rook went between, the captured piece,
+ * which the board keeps until then, and the state the move overwrote.
+ */
+class UndoInfo {
+  public:
+    int from;
+    int to;
+    Piece piece;
+    int rookFrom = -1;
+    int rookTo = -1;
+    BPiece* captured = nullptr;
+    int capturedSquare = -1;
+    Color current;
+    Position enPassant = Position(-1, -1);
+    uint8_t moved;
+    Position whiteKing = Position(-1, -1);
+    Position blackKing = Position(-1, -1);
+    uint64_t pieceHash;
+    uint64_t occupied;
+    int pieceCount[2][6];
+    int halfmoveClock;
+};
+
+/*
+ * Packed position, 32 bytes:
+ * - 0..7: occupancy, little endian, bit row * 8 + column set for every
+ *   occupied square.
+ * - 8..23: one nibble per occupied square in square order, low nibble
+ *   first, holding static_cast<int>(Piece) plus 8 for white.
+ * - 24: bit 0 set when black is to move, bits 1..6 the white king, left
+ *   rook and right rook moved flags followed by the black ones.
+ * - 25: square of the pawn that may be captured en passant, 0xFF if none.
+ * - 26: halfmove clock.
+ * - 27..31: zero.
+ */
+const int packedPositionSize = 32;
+
+/*
+ * Packed game: a packed start position, the number of moves in 16 bits
+ * and one 16 bit move each, all little endian. A move holds the from
+ * square in bits 0..5, the to square in bits 6..11 and the promotion
+ * piece as static_cast<int>(Piece) in bits 12..14, zero for none.
+ */
+const int packedGameHeaderSize = packedPositionSize + 2;
+
+/*
+ * Writes a packed position from one code per square, 0xFF when empty.
+ */
+void packPosition(const uint8_t codes[64], uint8_t flags, int enPassant, int halfmoveClock, uint8_t* out) {
+  uint64_t occupancy = 0;
+  for (int i = 8; i < packedPositionSize; i++) {
+    out[i] = 0;
+  }
+  int n = 0;
+  for (int s = 0; s < 64; s++) {
+    if (codes[s] != 0xFF) {
+      occupancy |= 1ULL << s;
+      out[8 + n / 2] |= codes[s] << (n % 2 * 4);
+      n++;
+    }
+  }
+  for (int i = 0; i < 8; i++) {
+    out[i] = occupancy >> (i * 8);
+  }
+  out[24] = flags;
+  out[25] = enPassant == -1 ? 0xFF : enPassant;
+  out[26] = halfmoveClock > 255 ? 255 : halfmoveClock;
+}
+
+uint16_t packMove(int from, int to, int promotion) {
+  return from | to << 6 | promotion << 12;
+}
+
+/*
+ * Is the square s attacked by a piece of color, 8 for white and 0 for
+ * black, on a board of square codes as packPosition() takes them?
+ */
+bool codesAttack(const uint8_t codes[64], int s, int color) {
+  uint64_t occupancy = 0;
+  for (int t = 0; t < 64; t++) {
+    if (codes[t] != 0xFF) {
+      occupancy |= 1ULL << t;
+    }
+  }
+  // a pawn attacks s from where a pawn of the other color on s would capture.
+  uint64_t pawns = squareTables.pawn[static_cast<int>(color == 8 ? Color::B : Color::W)][s];
+  const pair<uint64_t, Piece> leapers[3] = {{pawns, Piece::P}, {squareTables.horse[s], Piece::H}, {squareTables.king[s], Piece::K}};
+  for (auto& l : leapers) {
+    for (uint64_t mask = l.first; mask != 0; mask &= mask - 1) {
+      if (codes[__builtin_ctzll(mask)] == (static_cast<int>(l.second) | color)) {
+        return true;
+      }
+    }
+  }
+  for (int d = 0; d < 8; d++) {
+    int t = firstBlocker(d, s, occupancy);
+    int slider = static_cast<int>(d < 4 ? Piece::R : Piece::B);
+    if (t != -1 && (codes[t] == (slider | color) || codes[t] == (static_cast<int>(Piece::Q) | color))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Writes the packed position of a FEN string. The moved flags are taken
+ * from the castling rights: a rook whose castle is gone counts as moved,
+ * and so does the king once both castles are gone. Positions the board
+ * cannot play from safely are refused, FENs being user input.
+ */
+void packFen(string fen, uint8_t* out) {
+  istringstream in(fen);
+  string placement, side, castling = "-", enPassant = "-";
+  int halfmoveClock = 0;
+  in >> placement >> side >> castling >> enPassant >> halfmoveClock;
+  uint8_t codes[64];
+  int kings[2] = {0, 0};
+  int s = 0;
+  for (char c : placement) {
+    if (c == '/') {
+      continue;
+    }
+    if (c >= '1' && c <= '8') {
+      for (int i = 0; i < c - '0' && s < 64; i++) {
+        codes[s++] = 0xFF;
+      }
+      continue;
+    }
+    size_t p = string("kqrnbp").find(tolower(c));
+    if (p == string::npos || s >= 64) {
+      throw logic_error("Invalid FEN " + fen + "!");
+    }
+    bool white = isupper(c);
+    if (p == 0) {
+      kings[white]++;
+    }
+    codes[s++] = p | (white ? 8 : 0);
+  }
+  if (s != 64 || kings[0] != 1 || kings[1] != 1 || (side != "w" && side != "b")) {
+    throw logic_error("Invalid FEN " + fen + "!");
+  }
+  // no pawn on the first or last rank, and the player not to move is not in check.
+  int mover = side == "w" ? 8 : 0;
+  for (int i = 0; i < 64; i++) {
+    if (((i < 8 || i >= 56) && (codes[i] & 7) == static_cast<int>(Piece::P))
+        || (codes[i] == (8 - mover) && codesAttack(codes, i, mover))) {
+      throw logic_error("Invalid FEN " + fen + "!");
+    }
+  }
+  bool K = castling.find('K') != string::npos, Q = castling.find('Q') != string::npos;
+  bool k = castling.find('k') != string::npos, q = castling.find('q') != string::npos;
+  // a castling right needs its king and its rook on their home squares.
+  const bool rights[4] = {K, Q, k, q};
+  const int rookSquares[4] = {63, 56, 7, 0};
+  for (int i = 0; i < 4; i++) {
+    uint8_t color = i < 2 ? 8 : 0;
+    if (rights[i] && (codes[i < 2 ? 60 : 4] != color || codes[rookSquares[i]] != (2 | color))) {
+      throw logic_error("Invalid FEN " + fen + "!");
+    }
+  }
+  uint8_t flags = (side == "b") | (!K && !Q) << 1 | !Q << 2 | !K << 3 | (!k && !q) << 4 | !q << 5 | !k << 6;
+  int pawn = -1;
+  if (enPassant != "-") {
+    // the opponent just pushed a pawn two squares: white captures on the
+    // 6th rank, black on the 3rd.
+    if (enPassant.size() != 2 || enPassant[0] < 'a' || enPassant[0] > 'h' || enPassant[1] != (side == "w" ? '6' : '3')) {
+      throw logic_error("Invalid FEN " + fen + "!");
+    }
+    // FEN names the square behind the pawn, the board the pawn itself.
+    int behind = ('8' - enPassant[1]) * 8 + enPassant[0] - 'a';
+    int add = side == "w" ? 8 : -8;
+    pawn = behind + add;
+    if (codes[pawn] != (static_cast<int>(Piece::P) | (8 - mover)) || codes[behind] != 0xFF || codes[behind - add] != 0xFF) {
+      throw logic_error("Invalid FEN " + fen + "!");
+    }
+  }
+  packPosition(codes, flags, pawn, halfmoveClock, out);
+}
+
+/*
+ * Reads a packed position in place, nothing is copied or decoded upfront.
+ */
+class PositionView {
+    const uint8_t* data;
+  public:
+    PositionView(const uint8_t* data) {
+      this->data = data;
+    }
+    const uint8_t* getData() {
+      return data;
+    }
+    uint64_t getOccupancy() {
+      uint64_t occupancy = 0;
+      for (int i = 7; i >= 0; i--) {
+        occupancy = occupancy << 8 | data[i];
+      }
+      return occupancy;
+    }
+    bool isEmpty(int s) {
+      return (getOccupancy() >> s & 1) == 0;
+    }
+    // only meaningful for an occupied square.
+    int getCode(int s) {
+      int n = __builtin_popcountll(getOccupancy() & ((1ULL << s) - 1));
+      return data[8 + n / 2] >> (n % 2 * 4) & 15;
+    }
+    Piece getPiece(int s) {
+      return static_cast<Piece>(getCode(s) & 7);
+    }
+    Color getColor(int s) {
+      return (getCode(s) & 8) != 0 ? Color::W : Color::B;
+    }
+    Color getCurrent() {
+      return (data[24] & 1) != 0 ? Color::B : Color::W;
+    }
+    uint8_t getFlags() {
+      return data[24];
+    }
+    bool getWhiteKingMoved() {
+      return (data[24] & 2) != 0;
+    }
+    bool getWhiteLeftRookMoved() {
+      return (data[24] & 4) != 0;
+    }
+    bool getWhiteRightRookMoved() {
+      return (data[24] & 8) != 0;
+    }
+    bool getBlackKingMoved() {
+      return (data[24] & 16) != 0;
+    }
+    bool getBlackLeftRookMoved() {
+      return (data[24] & 32) != 0;
+    }
+    bool getBlackRightRookMoved() {
+      return (data[24] & 64) != 0;
+    }
+    // square of the pawn that may be captured en passant, -1 if none.
+    int getEnpassant() {
+      return data[25] == 0xFF ? -1 : data[25];
+    }
+    int getHalfmoveClock() {
+      return data[26];
+    }
+};
+
+class GameView {
+    const uint8_t* data;
+  public:
+    GameView(const uint8_t* data) {
+      this->data = data;
+    }
+    PositionView getStart() {
+      return PositionView(data);
+    }
+    int getMoveCount() {
+      return data[packedPositionSize] | data[packedPositionSize + 1] << 8;
+    }
+    uint16_t getMove(int i) {
+      const uint8_t* m = data + packedGameHeaderSize + 2 * i;
+      return m[0] | m[1] << 8;
+    }
+    size_t getSize() {
+      return packedGameHeaderSize + 2 * getMoveCount();
+    }
+};
+
+/*
+ * Iterates the packed positions stored back to back in a buffer, for
+ * instance a MappedFile.
+ */
+class PositionReader {
+    const uint8_t* data;
+    size_t size;
+    size_t offset = 0;
+  public:
+    PositionReader(const uint8_t* data, size_t size) {
+      this->data = data;
+      this->size = size;
+    }
+    bool hasNext() {
+      return offset + packedPositionSize <= size;
+    }
+    PositionView next() {
+      PositionView p = PositionView(data + offset);
+      offset += packedPositionSize;
+      return p;
+    }
+};
+
+/*
+ * Iterates the packed games stored back to back in a buffer. A truncated
+ * last game is not returned.
+ */
+class GameReader {
+    const uint8_t* data;
+    size_t size;
+    size_t offset = 0;
+  public:
+    GameReader(const uint8_t* data, size_t size) {
+      this->data = data;
+      this->size = size;
+    }
+    bool hasNext() {
+      return offset + packedGameHeaderSize <= size && offset + GameView(data + offset).getSize() <= size;
+    }
+    GameView next() {
+      GameView g = GameView(data + offset);
+      offset += g.getSize();
+      return g;
+    }
+};
+
+/*
+ * Steps through the positions of a packed game on a plain array of
+ * square codes, without building a Board. The moves are trusted to be
+ * legal, as written by Board::packGame.
+ */
+class GameReplay {
+    GameView game;
+    uint8_t codes[64];
+    uint8_t flags;
+    int enPassant;
+    int halfmoveClock;
+    int played = 0;
+  public:
+    GameReplay(GameView game) : game(game) {
+      PositionView start = game.getStart();
+      for (int s = 0; s < 64; s++) {
+        codes[s] = start.isEmpty(s) ? 0xFF : start.getCode(s);
+      }
+      flags = start.getFlags();
+      enPassant = start.getEnpassant();
+      halfmoveClock = start.getHalfmoveClock();
+    }
+    bool hasNext() {
+      return played < game.getMoveCount();
+    }
+    /*
+     * Plays the next move of the game.
+     */
+    void next() {
+      uint16_t m = game.getMove(played++);
+      int from = m & 63;
+      int to = m >> 6 & 63;
+      int promotion = m >> 12 & 7;
+      int code = codes[from];
+      Piece p = static_cast<Piece>(code & 7);
+      bool capture = codes[to] != 0xFF;
+      if (p == Piece::K && abs(to % 8 - from % 8) == 2) {
+        int row = from / 8;
+        int rookFrom = to % 8 == 6 ? row * 8 + 7 : row * 8;
+        int rookTo = to % 8 == 6 ? row * 8 + 5 : row * 8 + 3;
+        codes[rookTo] = codes[rookFrom];
+        codes[rookFrom] = 0xFF;
+      } else if (p == Piece::P && !capture && from % 8 != to % 8) {
+        codes[from / 8 * 8 + to % 8] = 0xFF;
+        capture = true;
+      }
+      codes[to] = promotion != 0 ? promotion | (code & 8) : code;
+      codes[from] = 0xFF;
+      enPassant = p == Piece::P && abs(to - from) == 16 ? to : -1;
+      halfmoveClock = capture || p == Piece::P ? 0 : halfmoveClock + 1;
+      // same rules as Board::move: a piece leaving its own corner, or any
+      // piece landing on a rook corner, clears the moved flag.
+      const int corners[6] = {60, 56, 63, 4, 0, 7};
+      for (int i = 0; i < 6; i++) {
+        if ((from == corners[i] && ((code & 8) != 0) == (i < 3)) || (to == corners[i] && i % 3 != 0)) {
+          flags |= 2 << i;
+        }
+      }
+      flags ^= 1;
+    }
+    void pack(uint8_t* out) {
+      packPosition(codes, flags, enPassant, halfmoveClock, out);
+    }
+};
+
+/*
+ * Read-only mapping of a whole file. The pages live in the page cache and
+ * are shared by every process mapping the same file.
+ */
+class MappedFile {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+  public:
+    MappedFile(string path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd == -1) {
+        throw logic_error("Cannot open " + path + "!");
+      }
+      struct stat st;
+      if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw logic_error("Cannot read " + path + "!");
+      }
+      size = st.st_size;
+      if (size > 0) {
+        void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+          close(fd);
+          throw logic_error("Cannot map " + path + "!");
+        }
+        data = static_cast<const uint8_t*>(p);
+      }
+      close(fd);
+    }
+    ~MappedFile() {
+      if (data != nullptr) {
+        munmap(const_cast<uint8_t*>(data), size);
+      }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    const uint8_t* getData() {
+      return data;
+    }
+    size_t getSize() {
+      return size;
+    }
+};
+
+/*
+ * Random64, the keys of the Polyglot opening book format, in its layout:
+ * 768 piece keys at 64 * kind + 8 * rank + file, where kind is 2 * piece
+ * + 1 for white with pieces in pawn, knight, bishop, rook, queen, king
+ * order and rank 0 is the first rank; then the white short, white long,
+ * black short and black long castling keys, eight en passant column keys
+ * and the key of white to move. These are the published constants, so
+ * keys match the books of every other Polyglot tool.
+ */
+constexpr uint64_t polyglotRandom[781] = {
+  0x9D39247E33776D41ULL, 0x2AF7398005AAA5C7ULL, 0x44DB015024623547ULL, 0x9C15F73E62A76AE2ULL,
+  0x75834465489C0C89ULL, 0x3290AC3A203001BFULL, 0x0FBBAD1F61042279ULL, 0xE83A908FF2FB60CAULL,
+  0x0D7E765D58755C10ULL, 0x1A083822CEAFE02DULL, 0x9605D5F0E25EC3B0ULL, 0xD021FF5CD13A2ED5ULL,
+  0x40BDF15D4A672E32ULL, 0x011355146FD56395ULL, 0x5DB4832046F3D9E5ULL, 0x239F8B2D7FF719CCULL,
+  0x05D1A1AE85B49AA1ULL, 0x679F848F6E8FC971ULL, 0x7449BBFF801FED0BULL, 0x7D11CDB1C3B7ADF0ULL,
+  0x82C7709E781EB7CCULL, 0xF3218F1C9510786CULL, 0x331478F3AF51BBE6ULL, 0x4BB38DE5E7219443ULL,
+  0xAA649C6EBCFD50FCULL, 0x8DBD98A352AFD40BULL, 0x87D2074B81D79217ULL, 0x19F3C751D3E92AE1ULL,
+  0xB4AB30F062B19ABFULL, 0x7B0500AC42047AC4ULL, 0xC9452CA81A09D85DULL, 0x24AA6C514DA27500ULL,
+  0x4C9F34427501B447ULL, 0x14A68FD73C910841ULL, 0xA71B9B83461CBD93ULL, 0x03488B95B0F1850FULL,
+  0x637B2B34FF93C040ULL, 0x09D1BC9A3DD90A94ULL, 0x3575668334A1DD3BULL, 0x735E2B97A4C45A23ULL,
+  0x18727070F1BD400BULL, 0x1FCBACD259BF02E7ULL, 0xD310A7C2CE9B6555ULL, 0xBF983FE0FE5D8244ULL,
+  0x9F74D14F7454A824ULL, 0x51EBDC4AB9BA3035ULL, 0x5C82C505DB9AB0FAULL, 0xFCF7FE8A3430B241ULL,
+  0x3253A729B9BA3DDEULL, 0x8C74C368081B3075ULL, 0xB9BC6C87167C33E7ULL, 0x7EF48F2B83024E20ULL,
+  0x11D505D4C351BD7FULL, 0x6568FCA92C76A243ULL, 0x4DE0B0F40F32A7B8ULL, 0x96D693460CC37E5DULL,
+  0x42E240CB63689F2FULL, 0x6D2BDCDAE2919661ULL, 0x42880B0236E4D951ULL, 0x5F0F4A5898171BB6ULL,
+  0x39F890F579F92F88ULL, 0x93C5B5F47356388BULL, 0x63DC359D8D231B78ULL, 0xEC16CA8AEA98AD76ULL,
+  0x5355F900C2A82DC7ULL, 0x07FB9F855A997142ULL, 0x5093417AA8A7ED5EULL, 0x7BCBC38DA25A7F3CULL,
+  0x19FC8A768CF4B6D4ULL, 0x637A7780DECFC0D9ULL, 0x8249A47AEE0E41F7ULL, 0x79AD695501E7D1E8ULL,
+  0x14ACBAF4777D5776ULL, 0xF145B6BECCDEA195ULL, 0xDABF2AC8201752FCULL, 0x24C3C94DF9C8D3F6ULL,
+  0xBB6E2924F03912EAULL, 0x0CE26C0B95C980D9ULL, 0xA49CD132BFBF7CC4ULL, 0xE99D662AF4243939ULL,
+  0x27E6AD7891165C3FULL, 0x8535F040B9744FF1ULL, 0x54B3F4FA5F40D873ULL, 0x72B12C32127FED2BULL,
+  0xEE954D3C7B411F47ULL, 0x9A85AC909A24EAA1ULL, 0x70AC4CD9F04F21F5ULL, 0xF9B89D3E99A075C2ULL,
+  0x87B3E2B2B5C907B1ULL, 0xA366E5B8C54F48B8ULL, 0xAE4A9346CC3F7CF2ULL, 0x1920C04D47267BBDULL,
+  0x87BF02C6B49E2AE9ULL, 0x092237AC237F3859ULL, 0xFF07F64EF8ED14D0ULL, 0x8DE8DCA9F03CC54EULL,
+  0x9C1633264DB49C89ULL, 0xB3F22C3D0B0B38EDULL, 0x390E5FB44D01144BULL, 0x5BFEA5B4712768E9ULL,
+  0x1E1032911FA78984ULL, 0x9A74ACB964E78CB3ULL, 0x4F80F7A035DAFB04ULL, 0x6304D09A0B3738C4ULL,
+  0x2171E64683023A08ULL, 0x5B9B63EB9CEFF80CULL, 0x506AACF489889342ULL, 0x1881AFC9A3A701D6ULL,
+  0x6503080440750644ULL, 0xDFD395339CDBF4A7ULL, 0xEF927DBCF00C20F2ULL, 0x7B32F7D1E03680ECULL,
+  0xB9FD7620E7316243ULL, 0x05A7E8A57DB91B77ULL, 0xB5889C6E15630A75ULL, 0x4A750A09CE9573F7ULL,
+  0xCF464CEC899A2F8AULL, 0xF538639CE705B824ULL, 0x3C79A0FF5580EF7FULL, 0xEDE6C87F8477609DULL,
+  0x799E81F05BC93F31ULL, 0x86536B8CF3428A8CULL, 0x97D7374C60087B73ULL, 0xA246637CFF328532ULL,
+  0x043FCAE60CC0EBA0ULL, 0x920E449535DD359EULL, 0x70EB093B15B290CCULL, 0x73A1921916591CBDULL,
+  0x56436C9FE1A1AA8DULL, 0xEFAC4B70633B8F81ULL, 0xBB215798D45DF7AFULL, 0x45F20042F24F1768ULL,
+  0x930F80F4E8EB7462ULL, 0xFF6712FFCFD75EA1ULL, 0xAE623FD67468AA70ULL, 0xDD2C5BC84BC8D8FCULL,
+  0x7EED120D54CF2DD9ULL, 0x22FE545401165F1CULL, 0xC91800E98FB99929ULL, 0x808BD68E6AC10365ULL,
+  0xDEC468145B7605F6ULL, 0x1BEDE3A3AEF53302ULL, 0x43539603D6C55602ULL, 0xAA969B5C691CCB7AULL,
+  0xA87832D392EFEE56ULL, 0x65942C7B3C7E11AEULL, 0xDED2D633CAD004F6ULL, 0x21F08570F420E565ULL,
+  0xB415938D7DA94E3CULL, 0x91B859E59ECB6350ULL, 0x10CFF333E0ED804AULL, 0x28AED140BE0BB7DDULL,
+  0xC5CC1D89724FA456ULL, 0x5648F680F11A2741ULL, 0x2D255069F0B7DAB3ULL, 0x9BC5A38EF729ABD4ULL,
+  0xEF2F054308F6A2BCULL, 0xAF2042F5CC5C2858ULL, 0x480412BAB7F5BE2AULL, 0xAEF3AF4A563DFE43ULL,
+  0x19AFE59AE451497FULL, 0x52593803DFF1E840ULL, 0xF4F076E65F2CE6F0ULL, 0x11379625747D5AF3ULL,
+  0xBCE5D2248682C115ULL, 0x9DA4243DE836994FULL, 0x066F70B33FE09017ULL, 0x4DC4DE189B671A1CULL,
+  0x51039AB7712457C3ULL, 0xC07A3F80C31FB4B4ULL, 0xB46EE9C5E64A6E7CULL, 0xB3819A42ABE61C87ULL,
+  0x21A007933A522A20ULL, 0x2DF16F761598AA4FULL, 0x763C4A1371B368FDULL, 0xF793C46702E086A0ULL,
+  0xD7288E012AEB8D31ULL, 0xDE336A2A4BC1C44BULL, 0x0BF692B38D079F23ULL, 0x2C604A7A177326B3ULL,
+  0x4850E73E03EB6064ULL, 0xCFC447F1E53C8E1BULL, 0xB05CA3F564268D99ULL, 0x9AE182C8BC9474E8ULL,
+  0xA4FC4BD4FC5558CAULL, 0xE755178D58FC4E76ULL, 0x69B97DB1A4C03DFEULL, 0xF9B5B7C4ACC67C96ULL,
+  0xFC6A82D64B8655FBULL, 0x9C684CB6C4D24417ULL, 0x8EC97D2917456ED0ULL, 0x6703DF9D2924E97EULL,
+  0xC547F57E42A7444EULL, 0x78E37644E7CAD29EULL, 0xFE9A44E9362F05FAULL, 0x08BD35CC38336615ULL,
+  0x9315E5EB3A129ACEULL, 0x94061B871E04DF75ULL, 0xDF1D9F9D784BA010ULL, 0x3BBA57B68871B59DULL,
+  0xD2B7ADEEDED1F73FULL, 0xF7A255D83BC373F8ULL, 0xD7F4F2448C0CEB81ULL, 0xD95BE88CD210FFA7ULL,
+  0x336F52F8FF4728E7ULL, 0xA74049DAC312AC71ULL, 0xA2F61BB6E437FDB5ULL, 0x4F2A5CB07F6A35B3ULL,
+  0x87D380BDA5BF7859ULL, 0x16B9F7E06C453A21ULL, 0x7BA2484C8A0FD54EULL, 0xF3A678CAD9A2E38CULL,
+  0x39B0BF7DDE437BA2ULL, 0xFCAF55C1BF8A4424ULL, 0x18FCF680573FA594ULL, 0x4C0563B89F495AC3ULL,
+  0x40E087931A00930DULL, 0x8CFFA9412EB642C1ULL, 0x68CA39053261169FULL, 0x7A1EE967D27579E2ULL,
+  0x9D1D60E5076F5B6FULL, 0x3810E399B6F65BA2ULL, 0x32095B6D4AB5F9B1ULL, 0x35CAB62109DD038AULL,
+  0xA90B24499FCFAFB1ULL, 0x77A225A07CC2C6BDULL, 0x513E5E634C70E331ULL, 0x4361C0CA3F692F12ULL,
+  0xD941ACA44B20A45BULL, 0x528F7C8602C5807BULL, 0x52AB92BEB9613989ULL, 0x9D1DFA2EFC557F73ULL,
+  0x722FF175F572C348ULL, 0x1D1260A51107FE97ULL, 0x7A249A57EC0C9BA2ULL, 0x04208FE9E8F7F2D6ULL,
+  0x5A110C6058B920A0ULL, 0x0CD9A497658A5698ULL, 0x56FD23C8F9715A4CULL, 0x284C847B9D887AAEULL,
+  0x04FEABFBBDB619CBULL, 0x742E1E651C60BA83ULL, 0x9A9632E65904AD3CULL, 0x881B82A13B51B9E2ULL,
+  0x506E6744CD974924ULL, 0xB0183DB56FFC6A79ULL, 0x0ED9B915C66ED37EULL, 0x5E11E86D5873D484ULL,
+  0xF678647E3519AC6EULL, 0x1B85D488D0F20CC5ULL, 0xDAB9FE6525D89021ULL, 0x0D151D86ADB73615ULL,
+  0xA865A54EDCC0F019ULL, 0x93C42566AEF98FFBULL, 0x99E7AFEABE000731ULL, 0x48CBFF086DDF285AULL,
+  0x7F9B6AF1EBF78BAFULL, 0x58627E1A149BBA21ULL, 0x2CD16E2ABD791E33ULL, 0xD363EFF5F0977996ULL,
+  0x0CE2A38C344A6EEDULL, 0x1A804AADB9CFA741ULL, 0x907F30421D78C5DEULL, 0x501F65EDB3034D07ULL,
+  0x37624AE5A48FA6E9ULL, 0x957BAF61700CFF4EULL, 0x3A6C27934E31188AULL, 0xD49503536ABCA345ULL,
+  0x088E049589C432E0ULL, 0xF943AEE7FEBF21B8ULL, 0x6C3B8E3E336139D3ULL, 0x364F6FFA464EE52EULL,
+  0xD60F6DCEDC314222ULL, 0x56963B0DCA418FC0ULL, 0x16F50EDF91E513AFULL, 0xEF1955914B609F93ULL,
+  0x565601C0364E3228ULL, 0xECB53939887E8175ULL, 0xBAC7A9A18531294BULL, 0xB344C470397BBA52ULL,
+  0x65D34954DAF3CEBDULL, 0xB4B81B3FA97511E2ULL, 0xB422061193D6F6A7ULL, 0x071582401C38434DULL,
+  0x7A13F18BBEDC4FF5ULL, 0xBC4097B116C524D2ULL, 0x59B97885E2F2EA28ULL, 0x99170A5DC3115544ULL,
+  0x6F423357E7C6A9F9ULL, 0x325928EE6E6F8794ULL, 0xD0E4366228B03343ULL, 0x565C31F7DE89EA27ULL,
+  0x30F5611484119414ULL, 0xD873DB391292ED4FULL, 0x7BD94E1D8E17DEBCULL, 0xC7D9F16864A76E94ULL,
+  0x947AE053EE56E63CULL, 0xC8C93882F9475F5FULL, 0x3A9BF55BA91F81CAULL, 0xD9A11FBB3D9808E4ULL,
+  0x0FD22063EDC29FCAULL, 0xB3F256D8ACA0B0B9ULL, 0xB03031A8B4516E84ULL, 0x35DD37D5871448AFULL,
+  0xE9F6082B05542E4EULL, 0xEBFAFA33D7254B59ULL, 0x9255ABB50D532280ULL, 0xB9AB4CE57F2D34F3ULL,
+  0x693501D628297551ULL, 0xC62C58F97DD949BFULL, 0xCD454F8F19C5126AULL, 0xBBE83F4ECC2BDECBULL,
+  0xDC842B7E2819E230ULL, 0xBA89142E007503B8ULL, 0xA3BC941D0A5061CBULL, 0xE9F6760E32CD8021ULL,
+  0x09C7E552BC76492FULL, 0x852F54934DA55CC9ULL, 0x8107FCCF064FCF56ULL, 0x098954D51FFF6580ULL,
+  0x23B70EDB1955C4BFULL, 0xC330DE426430F69DULL, 0x4715ED43E8A45C0AULL, 0xA8D7E4DAB780A08DULL,
+  0x0572B974F03CE0BBULL, 0xB57D2E985E1419C7ULL, 0xE8D9ECBE2CF3D73FULL, 0x2FE4B17170E59750ULL,
+  0x11317BA87905E790ULL, 0x7FBF21EC8A1F45ECULL, 0x1725CABFCB045B00ULL, 0x964E915CD5E2B207ULL,
+  0x3E2B8BCBF016D66DULL, 0xBE7444E39328A0ACULL, 0xF85B2B4FBCDE44B7ULL, 0x49353FEA39BA63B1ULL,
+  0x1DD01AAFCD53486AULL, 0x1FCA8A92FD719F85ULL, 0xFC7C95D827357AFAULL, 0x18A6A990C8B35EBDULL,
+  0xCCCB7005C6B9C28DULL, 0x3BDBB92C43B17F26ULL, 0xAA70B5B4F89695A2ULL, 0xE94C39A54A98307FULL,
+  0xB7A0B174CFF6F36EULL, 0xD4DBA84729AF48ADULL, 0x2E18BC1AD9704A68ULL, 0x2DE0966DAF2F8B1CULL,
+  0xB9C11D5B1E43A07EULL, 0x64972D68DEE33360ULL, 0x94628D38D0C20584ULL, 0xDBC0D2B6AB90A559ULL,
+  0xD2733C4335C6A72FULL, 0x7E75D99D94A70F4DULL, 0x6CED1983376FA72BULL, 0x97FCAACBF030BC24ULL,
+  0x7B77497B32503B12ULL, 0x8547EDDFB81CCB94ULL, 0x79999CDFF70902CBULL, 0xCFFE1939438E9B24ULL,
+  0x829626E3892D95D7ULL, 0x92FAE24291F2B3F1ULL, 0x63E22C147B9C3403ULL, 0xC678B6D860284A1CULL,
+  0x5873888850659AE7ULL, 0x0981DCD296A8736DULL, 0x9F65789A6509A440ULL, 0x9FF38FED72E9052FULL,
+  0xE479EE5B9930578CULL, 0xE7F28ECD2D49EECDULL, 0x56C074A581EA17FEULL, 0x5544F7D774B14AEFULL,
+  0x7B3F0195FC6F290FULL, 0x12153635B2C0CF57ULL, 0x7F5126DBBA5E0CA7ULL, 0x7A76956C3EAFB413ULL,
+  0x3D5774A11D31AB39ULL, 0x8A1B083821F40CB4ULL, 0x7B4A38E32537DF62ULL, 0x950113646D1D6E03ULL,
+  0x4DA8979A0041E8A9ULL, 0x3BC36E078F7515D7ULL, 0x5D0A12F27AD310D1ULL, 0x7F9D1A2E1EBE1327ULL,
+  0xDA3A361B1C5157B1ULL, 0xDCDD7D20903D0C25ULL, 0x36833336D068F707ULL, 0xCE68341F79893389ULL,
+  0xAB9090168DD05F34ULL, 0x43954B3252DC25E5ULL, 0xB438C2B67F98E5E9ULL, 0x10DCD78E3851A492ULL,
+  0xDBC27AB5447822BFULL, 0x9B3CDB65F82CA382ULL, 0xB67B7896167B4C84ULL, 0xBFCED1B0048EAC50ULL,
+  0xA9119B60369FFEBDULL, 0x1FFF7AC80904BF45ULL, 0xAC12FB171817EEE7ULL, 0xAF08DA9177DDA93DULL,
+  0x1B0CAB936E65C744ULL, 0xB559EB1D04E5E932ULL, 0xC37B45B3F8D6F2BAULL, 0xC3A9DC228CAAC9E9ULL,
+  0xF3B8B6675A6507FFULL, 0x9FC477DE4ED681DAULL, 0x67378D8ECCEF96CBULL, 0x6DD856D94D259236ULL,
+  0xA319CE15B0B4DB31ULL, 0x073973751F12DD5EULL, 0x8A8E849EB32781A5ULL, 0xE1925C71285279F5ULL,
+  0x74C04BF1790C0EFEULL, 0x4DDA48153C94938AULL, 0x9D266D6A1CC0542CULL, 0x7440FB816508C4FEULL,
+  0x13328503DF48229FULL, 0xD6BF7BAEE43CAC40ULL, 0x4838D65F6EF6748FULL, 0x1E152328F3318DEAULL,
+  0x8F8419A348F296BFULL, 0x72C8834A5957B511ULL, 0xD7A023A73260B45CULL, 0x94EBC8ABCFB56DAEULL,
+  0x9FC10D0F989993E0ULL, 0xDE68A2355B93CAE6ULL, 0xA44CFE79AE538BBEULL, 0x9D1D84FCCE371425ULL,
+  0x51D2B1AB2DDFB636ULL, 0x2FD7E4B9E72CD38CULL, 0x65CA5B96B7552210ULL, 0xDD69A0D8AB3B546DULL,
+  0x604D51B25FBF70E2ULL, 0x73AA8A564FB7AC9EULL, 0x1A8C1E992B941148ULL, 0xAAC40A2703D9BEA0ULL,
+  0x764DBEAE7FA4F3A6ULL, 0x1E99B96E70A9BE8BULL, 0x2C5E9DEB57EF4743ULL, 0x3A938FEE32D29981ULL,
+  0x26E6DB8FFDF5ADFEULL, 0x469356C504EC9F9DULL, 0xC8763C5B08D1908CULL, 0x3F6C6AF859D80055ULL,
+  0x7F7CC39420A3A545ULL, 0x9BFB227EBDF4C5CEULL, 0x89039D79D6FC5C5CULL, 0x8FE88B57305E2AB6ULL,
+  0xA09E8C8C35AB96DEULL, 0xFA7E393983325753ULL, 0xD6B6D0ECC617C699ULL, 0xDFEA21EA9E7557E3ULL,
+  0xB67C1FA481680AF8ULL, 0xCA1E3785A9E724E5ULL, 0x1CFC8BED0D681639ULL, 0xD18D8549D140CAEAULL,
+  0x4ED0FE7E9DC91335ULL, 0xE4DBF0634473F5D2ULL, 0x1761F93A44D5AEFEULL, 0x53898E4C3910DA55ULL,
+  0x734DE8181F6EC39AULL, 0x2680B122BAA28D97ULL, 0x298AF231C85BAFABULL, 0x7983EED3740847D5ULL,
+  0x66C1A2A1A60CD889ULL, 0x9E17E49642A3E4C1ULL, 0xEDB454E7BADC0805ULL, 0x50B704CAB602C329ULL,
+  0x4CC317FB9CDDD023ULL, 0x66B4835D9EAFEA22ULL, 0x219B97E26FFC81BDULL, 0x261E4E4C0A333A9DULL,
+  0x1FE2CCA76517DB90ULL, 0xD7504DFA8816EDBBULL, 0xB9571FA04DC089C8ULL, 0x1DDC0325259B27DEULL,
+  0xCF3F4688801EB9AAULL, 0xF4F5D05C10CAB243ULL, 0x38B6525C21A42B0EULL, 0x36F60E2BA4FA6800ULL,
+  0xEB3593803173E0CEULL, 0x9C4CD6257C5A3603ULL, 0xAF0C317D32ADAA8AULL, 0x258E5A80C7204C4BULL,
+  0x8B889D624D44885DULL, 0xF4D14597E660F855ULL, 0xD4347F66EC8941C3ULL, 0xE699ED85B0DFB40DULL,
+  0x2472F6207C2D0484ULL, 0xC2A1E7B5B459AEB5ULL, 0xAB4F6451CC1D45ECULL, 0x63767572AE3D6174ULL,
+  0xA59E0BD101731A28ULL, 0x116D0016CB948F09ULL, 0x2CF9C8CA052F6E9FULL, 0x0B090A7560A968E3ULL,
+  0xABEEDDB2DDE06FF1ULL, 0x58EFC10B06A2068DULL, 0xC6E57A78FBD986E0ULL, 0x2EAB8CA63CE802D7ULL,
+  0x14A195640116F336ULL, 0x7C0828DD624EC390ULL, 0xD74BBE77E6116AC7ULL, 0x804456AF10F5FB53ULL,
+  0xEBE9EA2ADF4321C7ULL, 0x03219A39EE587A30ULL, 0x49787FEF17AF9924ULL, 0xA1E9300CD8520548ULL,
+  0x5B45E522E4B1B4EFULL, 0xB49C3B3995091A36ULL, 0xD4490AD526F14431ULL, 0x12A8F216AF9418C2ULL,
+  0x001F837CC7350524ULL, 0x1877B51E57A764D5ULL, 0xA2853B80F17F58EEULL, 0x993E1DE72D36D310ULL,
+  0xB3598080CE64A656ULL, 0x252F59CF0D9F04BBULL, 0xD23C8E176D113600ULL, 0x1BDA0492E7E4586EULL,
+  0x21E0BD5026C619BFULL, 0x3B097ADAF088F94EULL, 0x8D14DEDB30BE846EULL, 0xF95CFFA23AF5F6F4ULL,
+  0x3871700761B3F743ULL, 0xCA672B91E9E4FA16ULL, 0x64C8E531BFF53B55ULL, 0x241260ED4AD1E87DULL,
+  0x106C09B972D2E822ULL, 0x7FBA195410E5CA30ULL, 0x7884D9BC6CB569D8ULL, 0x0647DFEDCD894A29ULL,
+  0x63573FF03E224774ULL, 0x4FC8E9560F91B123ULL, 0x1DB956E450275779ULL, 0xB8D91274B9E9D4FBULL,
+  0xA2EBEE47E2FBFCE1ULL, 0xD9F1F30CCD97FB09ULL, 0xEFED53D75FD64E6BULL, 0x2E6D02C36017F67FULL,
+  0xA9AA4D20DB084E9BULL, 0xB64BE8D8B25396C1ULL, 0x70CB6AF7C2D5BCF0ULL, 0x98F076A4F7A2322EULL,
+  0xBF84470805E69B5FULL, 0x94C3251F06F90CF3ULL, 0x3E003E616A6591E9ULL, 0xB925A6CD0421AFF3ULL,
+  0x61BDD1307C66E300ULL, 0xBF8D5108E27E0D48ULL, 0x240AB57A8B888B20ULL, 0xFC87614BAF287E07ULL,
+  0xEF02CDD06FFDB432ULL, 0xA1082C0466DF6C0AULL, 0x8215E577001332C8ULL, 0xD39BB9C3A48DB6CFULL,
+  0x2738259634305C14ULL, 0x61CF4F94C97DF93DULL, 0x1B6BACA2AE4E125BULL, 0x758F450C88572E0BULL,
+  0x959F587D507A8359ULL, 0xB063E962E045F54DULL, 0x60E8ED72C0DFF5D1ULL, 0x7B64978555326F9FULL,
+  0xFD080D236DA814BAULL, 0x8C90FD9B083F4558ULL, 0x106F72FE81E2C590ULL, 0x7976033A39F7D952ULL,
+  0xA4EC0132764CA04BULL, 0x733EA705FAE4FA77ULL, 0xB4D8F77BC3E56167ULL, 0x9E21F4F903B33FD9ULL,
+  0x9D765E419FB69F6DULL, 0xD30C088BA61EA5EFULL, 0x5D94337FBFAF7F5BULL, 0x1A4E4822EB4D7A59ULL,
+  0x6FFE73E81B637FB3ULL, 0xDDF957BC36D8B9CAULL, 0x64D0E29EEA8838B3ULL, 0x08DD9BDFD96B9F63ULL,
+  0x087E79E5A57D1D13ULL, 0xE328E230E3E2B3FBULL, 0x1C2559E30F0946BEULL, 0x720BF5F26F4D2EAAULL,
+  0xB0774D261CC609DBULL, 0x443F64EC5A371195ULL, 0x4112CF68649A260EULL, 0xD813F2FAB7F5C5CAULL,
+  0x660D3257380841EEULL, 0x59AC2C7873F910A3ULL, 0xE846963877671A17ULL, 0x93B633ABFA3469F8ULL,
+  0xC0C0F5A60EF4CDCFULL, 0xCAF21ECD4377B28CULL, 0x57277707199B8175ULL, 0x506C11B9D90E8B1DULL,
+  0xD83CC2687A19255FULL, 0x4A29C6465A314CD1ULL, 0xED2DF21216235097ULL, 0xB5635C95FF7296E2ULL,
+  0x22AF003AB672E811ULL, 0x52E762596BF68235ULL, 0x9AEBA33AC6ECC6B0ULL, 0x944F6DE09134DFB6ULL,
+  0x6C47BEC883A7DE39ULL, 0x6AD047C430A12104ULL, 0xA5B1CFDBA0AB4067ULL, 0x7C45D833AFF07862ULL,
+  0x5092EF950A16DA0BULL, 0x9338E69C052B8E7BULL, 0x455A4B4CFE30E3F5ULL, 0x6B02E63195AD0CF8ULL,
+  0x6B17B224BAD6BF27ULL, 0xD1E0CCD25BB9C169ULL, 0xDE0C89A556B9AE70ULL, 0x50065E535A213CF6ULL,
+  0x9C1169FA2777B874ULL, 0x78EDEFD694AF1EEDULL, 0x6DC93D9526A50E68ULL, 0xEE97F453F06791EDULL,
+  0x32AB0EDB696703D3ULL, 0x3A6853C7E70757A7ULL, 0x31865CED6120F37DULL, 0x67FEF95D92607890ULL,
+  0x1F2B1D1F15F6DC9CULL, 0xB69E38A8965C6B65ULL, 0xAA9119FF184CCCF4ULL, 0xF43C732873F24C13ULL,
+  0xFB4A3D794A9A80D2ULL, 0x3550C2321FD6109CULL, 0x371F77E76BB8417EULL, 0x6BFA9AAE5EC05779ULL,
+  0xCD04F3FF001A4778ULL, 0xE3273522064480CAULL, 0x9F91508BFFCFC14AULL, 0x049A7F41061A9E60ULL,
+  0xFCB6BE43A9F2FE9BULL, 0x08DE8A1C7797DA9BULL, 0x8F9887E6078735A1ULL, 0xB5B4071DBFC73A66ULL,
+  0x230E343DFBA08D33ULL, 0x43ED7F5A0FAE657DULL, 0x3A88A0FBBCB05C63ULL, 0x21874B8B4D2DBC4FULL,
+  0x1BDEA12E35F6A8C9ULL, 0x53C065C6C8E63528ULL, 0xE34A1D250E7A8D6BULL, 0xD6B04D3B7651DD7EULL,
+  0x5E90277E7CB39E2DULL, 0x2C046F22062DC67DULL, 0xB10BB459132D0A26ULL, 0x3FA9DDFB67E2F199ULL,
+  0x0E09B88E1914F7AFULL, 0x10E8B35AF3EEAB37ULL, 0x9EEDECA8E272B933ULL, 0xD4C718BC4AE8AE5FULL,
+  0x81536D601170FC20ULL, 0x91B534F885818A06ULL, 0xEC8177F83F900978ULL, 0x190E714FADA5156EULL,
+  0xB592BF39B0364963ULL, 0x89C350C893AE7DC1ULL, 0xAC042E70F8B383F2ULL, 0xB49B52E587A1EE60ULL,
+  0xFB152FE3FF26DA89ULL, 0x3E666E6F69AE2C15ULL, 0x3B544EBE544C19F9ULL, 0xE805A1E290CF2456ULL,
+  0x24B33C9D7ED25117ULL, 0xE74733427B72F0C1ULL, 0x0A804D18B7097475ULL, 0x57E3306D881EDB4FULL,
+  0x4AE7D6A36EB5DBCBULL, 0x2D8D5432157064C8ULL, 0xD1E649DE1E7F268BULL, 0x8A328A1CEDFE552CULL,
+  0x07A3AEC79624C7DAULL, 0x84547DDC3E203C94ULL, 0x990A98FD5071D263ULL, 0x1A4FF12616EEFC89ULL,
+  0xF6F7FD1431714200ULL, 0x30C05B1BA332F41CULL, 0x8D2636B81555A786ULL, 0x46C9FEB55D120902ULL,
+  0xCCEC0A73B49C9921ULL, 0x4E9D2827355FC492ULL, 0x19EBB029435DCB0FULL, 0x4659D2B743848A2CULL,
+  0x963EF2C96B33BE31ULL, 0x74F85198B05A2E7DULL, 0x5A0F544DD2B1FB18ULL, 0x03727073C2E134B1ULL,
+  0xC7F6AA2DE59AEA61ULL, 0x352787BAA0D7C22FULL, 0x9853EAB63B5E0B35ULL, 0xABBDCDD7ED5C0860ULL,
+  0xCF05DAF5AC8D77B0ULL, 0x49CAD48CEBF4A71EULL, 0x7A4C10EC2158C4A6ULL, 0xD9E92AA246BF719EULL,
+  0x13AE978D09FE5557ULL, 0x730499AF921549FFULL, 0x4E4B705B92903BA4ULL, 0xFF577222C14F0A3AULL,
+  0x55B6344CF97AAFAEULL, 0xB862225B055B6960ULL, 0xCAC09AFBDDD2CDB4ULL, 0xDAF8E9829FE96B5FULL,
+  0xB5FDFC5D3132C498ULL, 0x310CB380DB6F7503ULL, 0xE87FBB46217A360EULL, 0x2102AE466EBB1148ULL,
+  0xF8549E1A3AA5E00DULL, 0x07A69AFDCC42261AULL, 0xC4C118BFE78FEAAEULL, 0xF9F4892ED96BD438ULL,
+  0x1AF3DBE25D8F45DAULL, 0xF5B4B0B0D2DEEEB4ULL, 0x962ACEEFA82E1C84ULL, 0x046E3ECAAF453CE9ULL,
+  0xF05D129681949A4CULL, 0x964781CE734B3C84ULL, 0x9C2ED44081CE5FBDULL, 0x522E23F3925E319EULL,
+  0x177E00F9FC32F791ULL, 0x2BC60A63A6F3B3F2ULL, 0x222BBFAE61725606ULL, 0x486289DDCC3D6780ULL,
+  0x7DC7785B8EFDFC80ULL, 0x8AF38731C02BA980ULL, 0x1FAB64EA29A2DDF7ULL, 0xE4D9429322CD065AULL,
+  0x9DA058C67844F20CULL, 0x24C0E332B70019B0ULL, 0x233003B5A6CFE6ADULL, 0xD586BD01C5C217F6ULL,
+  0x5E5637885F29BC2BULL, 0x7EBA726D8C94094BULL, 0x0A56A5F0BFE39272ULL, 0xD79476A84EE20D06ULL,
+  0x9E4C1269BAA4BF37ULL, 0x17EFEE45B0DEE640ULL, 0x1D95B0A5FCF90BC6ULL, 0x93CBE0B699C2585DULL,
+  0x65FA4F227A2B6D79ULL, 0xD5F9E858292504D5ULL, 0xC2B5A03F71471A6FULL, 0x59300222B4561E00ULL,
+  0xCE2F8642CA0712DCULL, 0x7CA9723FBB2E8988ULL, 0x2785338347F2BA08ULL, 0xC61BB3A141E50E8CULL,
+  0x150F361DAB9DEC26ULL, 0x9F6A419D382595F4ULL, 0x64A53DC924FE7AC9ULL, 0x142DE49FFF7A7C3DULL,
+  0x0C335248857FA9E7ULL, 0x0A9C32D5EAE45305ULL, 0xE6C42178C4BBB92EULL, 0x71F1CE2490D20B07ULL,
+  0xF1BCC3D275AFE51AULL, 0xE728E8C83C334074ULL, 0x96FBF83A12884624ULL, 0x81A1549FD6573DA5ULL,
+  0x5FA7867CAF35E149ULL, 0x56986E2EF3ED091BULL, 0x917F1DD5F8886C61ULL, 0xD20D8C88C8FFE65FULL,
+  0x31D71DCE64B2C310ULL, 0xF165B587DF898190ULL, 0xA57E6339DD2CF3A0ULL, 0x1EF6E6DBB1961EC9ULL,
+  0x70CC73D90BC26E24ULL, 0xE21A6B35DF0C3AD7ULL, 0x003A93D8B2806962ULL, 0x1C99DED33CB890A1ULL,
+  0xCF3145DE0ADD4289ULL, 0xD0E4427A5514FB72ULL, 0x77C621CC9FB3A483ULL, 0x67A34DAC4356550BULL,
+  0xF8D626AAAF278509ULL
+};
+
+/*
+ * Key of the starting position, computed from the table; the reference
+ * value of the Polyglot format guards the constants above against typos.
+ */
+constexpr uint64_t polyglotStartKey() {
+  // kind of the black back rank from the a to the h file, white is + 1.
+  const int back[8] = {6, 2, 4, 8, 10, 4, 2, 6};
+  uint64_t key = 0;
+  for (int j = 0; j < 8; j++) {
+    key ^= polyglotRandom[64 * back[j] + 56 + j] ^ polyglotRandom[64 * (back[j] + 1) + j];
+    key ^= polyglotRandom[48 + j] ^ polyglotRandom[64 + 8 + j];
+  }
+  for (int i = 768; i < 772; i++) {
+    key ^= polyglotRandom[i];
+  }
+  return key ^ polyglotRandom[780];
+}
+
+static_assert(polyglotStartKey() == 0x463B96181691FC9CULL, "Polyglot start position key mismatch!");
+
+// Polyglot kind of each Piece in enum order K, Q, R, H, B, P, black.
+constexpr int polyglotKinds[6] = {10, 8, 6, 2, 4, 0};
+
+/*
+ * Polyglot book entries are 16 bytes, big endian: key (8), move (2),
+ * weight (2) and learn (4), sorted by key.
+ */
+const int bookEntrySize = 16;
+
+uint64_t readBigEndian(const uint8_t* p, int n) {
+  uint64_t v = 0;
+  for (int i = 0; i < n; i++) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+void writeBigEndian(uint64_t v, int n, vector<uint8_t>& out) {
+  for (int i = n - 1; i >= 0; i--) {
+    out.push_back(v >> (i * 8) & 0xFF);
+  }
+}
+
+class BookMove {
+  public:
+    Position from;
+    Position to;
+    // Piece::K when the move is not a promotion.
+    Piece promotion;
+    int weight;
+    BookMove(Position from, Position to, Piece promotion, int weight) : from(from), to(to) {
+      this->promotion = promotion;
+      this->weight = weight;
+    }
+};
+
+/*
+ * Polyglot .bin opening book on a MappedFile, so a probe touches only the
+ * pages the binary search visits. One Book can serve any number of boards.
+ */
+class Book {
+    MappedFile file;
+  public:
+    Book(string path) : file(path) {
+    }
+
+    /*
+     * Returns the moves stored for key, as written in the book: castling
+     * is the king taking its own rook and nothing is checked for legality,
+     * see Board::probeBook().
+     */
+    vector<BookMove> probe(uint64_t key) {
+      vector<BookMove> moves;
+      const uint8_t* data = file.getData();
+      size_t lo = 0;
+      size_t hi = file.getSize() / bookEntrySize;
+      while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (readBigEndian(data + mid * bookEntrySize, 8) < key) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      const Piece promotions[5] = {Piece::K, Piece::H, Piece::B, Piece::R, Piece::Q};
+      for (size_t i = lo; i < file.getSize() / bookEntrySize; i++) {
+        const uint8_t* e = data + i * bookEntrySize;
+        if (readBigEndian(e, 8) != key) {
+          break;
+        }
+        int m = readBigEndian(e + 8, 2);
+        int promotion = m >> 12 & 7;
+        moves.push_back(BookMove(Position(7 - (m >> 9 & 7), m >> 6 & 7), Position(7 - (m >> 3 & 7), m & 7),
+            promotion <= 4 ? promotions[promotion] : Piece::K, readBigEndian(e + 10, 2)));
+      }
+      return moves;
+    }
+};
+
 class Board {
     BPiece* b[8][8];
     Color current;
@@ -106,7 +1198,26 @@ class Board {
     bool whiteLeftRookMoved = false;
     bool whiteRightRookMoved = false;
     Position promotion = Position(-1, -1);
+    bool promotionDiscoveredCheck = false;
+    Position whiteKing = Position(7, 4);
+    Position blackKing = Position(0, 4);
     bool checkmate = false;
+    Draw draw = Draw::None;
+    // hash of the pieces only, castling rights, en passant and the side
+    // to move are added by getHash().
+    uint64_t pieceHash = 0;
+    // squares holding a piece, kept along with pieceHash by toggle().
+    uint64_t occupied = 0;
+    int pieceCount[2][6] = {};
+    // moves since the last capture or pawn move.
+    int halfmoveClock = 0;
+    // hash of every position of the game, the current one last.
+    vector<uint64_t> history;
+    // packed start position and moves, see packGame().
+    uint8_t start[packedPositionSize];
+    vector<uint16_t> played;
+    // one entry per move played, the last one taken back by undo().
+    vector<UndoInfo> undos;
     std::map<Piece, MoveCalculator*> calculators;
     Position validatePosition(string p) {
       if (p.size() != 2) {
@@ -123,46 +1234,373 @@ class Board {
       return Position('8' - row, column - 'a');
     }
     void init();
-  public:
-    Board() {
 
-      enPassant = Position(-1, -1);
-      current = Color::W; 
+    static uint64_t square(int row, int column) {
+      return 1ULL << (row * 8 + column);
+    }
 
-      b[0][0] = new BPiece(Piece::R, Color::B);
-      b[0][1] = new BPiece(Piece::H, Color::B);
-      b[0][2] = new BPiece(Piece::B, Color::B);
-      b[0][3] = new BPiece(Piece::Q, Color::B);
-      b[0][4] = new BPiece(Piece::K, Color::B);
-      b[0][5] = new BPiece(Piece::B, Color::B);
-      b[0][6] = new BPiece(Piece::H, Color::B);
-      b[0][7] = new BPiece(Piece::R, Color::B);
+    void toggle(BPiece* bp, int s) {
+      pieceHash ^= zobristKeys.piece[static_cast<int>(bp->getColor())][static_cast<int>(bp->getPiece())][s];
+      occupied ^= 1ULL << s;
+    }
 
-      b[1][0] = new BPiece(Piece::P, Color::B);
-      b[1][1] = new BPiece(Piece::P, Color::B);
-      b[1][2] = new BPiece(Piece::P, Color::B);
-      b[1][3] = new BPiece(Piece::P, Color::B);
-      b[1][4] = new BPiece(Piece::P, Color::B);
-      b[1][5] = new BPiece(Piece::P, Color::B);
-      b[1][6] = new BPiece(Piece::P, Color::B);
-      b[1][7] = new BPiece(Piece::P, Color::B);
+    /*
+     * Has the current player a pawn next to the pawn that may be taken en passant?
+     */
+    bool enPassantCapturable() {
+      int r = enPassant.getRow();
+      int c = enPassant.getColumn();
+      if (r == -1) {
+        return false;
+      }
+      for (int a = c - 1; a <= c + 1; a += 2) {
+        BPiece * bp = onBoard(r, a) ? b[r][a] : nullptr;
+        if (bp != nullptr && bp->getColor() == current && bp->getPiece() == Piece::P) {
+          return true;
+        }
+      }
+      return false;
+    }
 
-      b[2][0] = nullptr;
-      b[2][1] = nullptr;
-      b[2][2] = nullptr;
-      b[2][3] = nullptr;
-      b[2][4] = nullptr;
-      b[2][5] = nullptr;
-      b[2][6] = nullptr;
-      b[2][7] = nullptr;
-      
-      b[3][0] = nullptr;
-      b[3][1] = nullptr;
-      b[3][2] = nullptr;
-      b[3][3] = nullptr;
-      b[3][4] = nullptr;
-      b[3][5] = nullptr;
-      b[3][6] = nullptr;
+    int castleRights() {
+      return (!whiteKingMoved && !whiteRightRookMoved)
+          | (!whiteKingMoved && !whiteLeftRookMoved) << 1
+          | (!blackKingMoved && !blackRightRookMoved) << 2
+          | (!blackKingMoved && !blackLeftRookMoved) << 3;
+    }
+
+    /*
+     * Repetition: the same position, with the same side to move, seen
+     * twice before since the last irreversible move.
+     */
+    bool isRepetition() {
+      int n = history.size() - 1;
+      int count = 1;
+      for (int i = n - 4; i >= 0 && i >= n - halfmoveClock; i -= 2) {
+        if (history[i] == history[n] && ++count == 3) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    /*
+     * No checkmate is possible when only kings and either a single minor
+     * piece or bishops all standing on the same square color are left.
+     */
+    bool isInsufficientMaterial() {
+      for (int c = 0; c < 2; c++) {
+        if (pieceCount[c][static_cast<int>(Piece::P)] + pieceCount[c][static_cast<int>(Piece::R)] + pieceCount[c][static_cast<int>(Piece::Q)] != 0) {
+          return false;
+        }
+      }
+      int horses = pieceCount[0][static_cast<int>(Piece::H)] + pieceCount[1][static_cast<int>(Piece::H)];
+      int bishops = pieceCount[0][static_cast<int>(Piece::B)] + pieceCount[1][static_cast<int>(Piece::B)];
+      if (horses + bishops <= 1) {
+        return true;
+      }
+      if (horses != 0) {
+        return false;
+      }
+      int colors = 0;
+      for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+          if (b[i][j] != nullptr && b[i][j]->getPiece() == Piece::B) {
+            colors |= 1 << ((i + j) % 2);
+          }
+        }
+      }
+      return colors != 3;
+    }
+
+    /*
+     * Draw status of the current player after the position has been
+     * recorded in history. Only called when the current is not checkmated.
+     */
+    Draw drawStatus(bool check) {
+      if (!check && !legalMoves(nullptr)) {
+        return Draw::Stalemate;
+      }
+      if (halfmoveClock >= 100) {
+        return Draw::FiftyMoves;
+      }
+      if (isRepetition()) {
+        return Draw::Repetition;
+      }
+      if (isInsufficientMaterial()) {
+        return Draw::InsufficientMaterial;
+      }
+      return Draw::None;
+    }
+
+    Color opponent() {
+      return current == Color::W ? Color::B : Color::W;
+    }
+
+    Position findKing(Color color) {
+      return color == Color::W ? whiteKing : blackKing;
+    }
+
+    /*
+     * Does the opponent piece standing on s attack the current king?
+     */
+    bool attacksKing(int s, Position& king) {
+      BPiece * bp = b[s / 8][s % 8];
+      int k = king.getSquare();
+      uint64_t target = 1ULL << k;
+      switch (bp->getPiece()) {
+        case Piece::P:
+          return (squareTables.pawn[static_cast<int>(bp->getColor())][s] & target) != 0;
+        case Piece::H:
+          return (squareTables.horse[s] & target) != 0;
+        case Piece::K:
+          return false;
+        case Piece::R:
+          return (squareTables.rook[s] & target) != 0 && isEmpty(squareTables.between[s][k]);
+        case Piece::B:
+          return (squareTables.bishop[s] & target) != 0 && isEmpty(squareTables.between[s][k]);
+        default:
+          return squareTables.line[s][k] != 0 && isEmpty(squareTables.between[s][k]);
+      }
+    }
+
+    /*
+     * Does emptying the square s uncover an opponent slider on the current king?
+     */
+    bool uncoversKing(int s, Position& king) {
+      int k = king.getRow() * 8 + king.getColumn();
+      if (squareTables.line[k][s] == 0 || !isEmpty(squareTables.between[k][s])) {
+        return false;
+      }
+      int d = 0;
+      while ((squareTables.ray[d][k] >> s & 1) == 0) {
+        d++;
+      }
+      int t = firstBlocker(d, s, occupied);
+      if (t == -1) {
+        return false;
+      }
+      BPiece * bp = b[t / 8][t % 8];
+      Piece slider = d < 4 ? Piece::R : Piece::B;
+      return bp->getColor() != current && (bp->getPiece() == slider || bp->getPiece() == Piece::Q);
+    }
+
+    /*
+     * Returns the squares of the pieces of color 'by' attacking (row, column).
+     * The square (ignoreRow, ignoreColumn) is seen as empty, so a king can
+     * test where it goes without sheltering behind itself.
+     */
+    uint64_t attackers(int row, int column, Color by, int ignoreRow = -1, int ignoreColumn = -1) {
+      int s = row * 8 + column;
+      int ignore = ignoreRow * 8 + ignoreColumn;
+      Color other = by == Color::W ? Color::B : Color::W;
+      uint64_t result = piecesIn(squareTables.pawn[static_cast<int>(other)][s], Piece::P, by, ignore)
+          | piecesIn(squareTables.horse[s], Piece::H, by, ignore)
+          | piecesIn(squareTables.king[s], Piece::K, by, ignore);
+      uint64_t occupancy = ignoreRow == -1 ? occupied : occupied & ~square(ignoreRow, ignoreColumn);
+      for (int d = 0; d < 8; d++) {
+        int t = firstBlocker(d, s, occupancy);
+        if (t == -1) {
+          continue;
+        }
+        BPiece * bp = b[t / 8][t % 8];
+        Piece slider = d < 4 ? Piece::R : Piece::B;
+        if (bp->getColor() == by && (bp->getPiece() == slider || bp->getPiece() == Piece::Q)) {
+          result |= 1ULL << t;
+        }
+      }
+      return result;
+    }
+
+    /*
+     * Keeps the squares of mask holding a piece p of color 'by'.
+     */
+    uint64_t piecesIn(uint64_t mask, Piece p, Color by, int ignore) {
+      uint64_t result = 0;
+      while (mask != 0) {
+        int s = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        BPiece * bp = b[s / 8][s % 8];
+        if (bp != nullptr && s != ignore && bp->getColor() == by && bp->getPiece() == p) {
+          result |= 1ULL << s;
+        }
+      }
+      return result;
+    }
+
+    CheckInfo checkInfo() {
+      CheckInfo ci;
+      ci.king = findKing(current);
+      int kr = ci.king.getRow();
+      int kc = ci.king.getColumn();
+      ci.checkers = attackers(kr, kc, opponent());
+      if (ci.checkers == 0) {
+        ci.checkMask = ~0ULL;
+      } else if ((ci.checkers & (ci.checkers - 1)) == 0) {
+        int s = __builtin_ctzll(ci.checkers);
+        ci.checkMask = ci.checkers;
+        Piece p = b[s / 8][s % 8]->getPiece();
+        if (p == Piece::Q || p == Piece::R || p == Piece::B) {
+          ci.checkMask |= squareTables.between[kr * 8 + kc][s];
+        }
+      }
+      int k = kr * 8 + kc;
+      for (int d = 0; d < 8; d++) {
+        // a piece of the current player, then an opponent slider behind it.
+        int pinned = firstBlocker(d, k, occupied);
+        if (pinned == -1 || b[pinned / 8][pinned % 8]->getColor() != current) {
+          continue;
+        }
+        int pinner = firstBlocker(d, pinned, occupied);
+        if (pinner == -1) {
+          continue;
+        }
+        BPiece * bp = b[pinner / 8][pinner % 8];
+        Piece slider = d < 4 ? Piece::R : Piece::B;
+        if (bp->getColor() != current && (bp->getPiece() == slider || bp->getPiece() == Piece::Q)) {
+          ci.pinned |= 1ULL << pinned;
+          ci.pinLine[pinned] = squareTables.ray[d][k] & ~squareTables.ray[d][pinner];
+        }
+      }
+      return ci;
+    }
+
+    /*
+     * Decides if a move accepted by its calculator leaves the king safe.
+     * Only king moves and en passant need an attack test, every other
+     * move is filtered by the check mask and the pin lines.
+     */
+    bool isLegal(CheckInfo& ci, Position& from, Position& to, MoveResult& mr) {
+      BPiece * bp = get(from);
+      if (bp->getPiece() == Piece::K) {
+        if (mr.smallCastle || mr.bigCastle) {
+          // canExecuteSmallCastle/canExecuteBigCastle already tested the king path.
+          return true;
+        }
+        return attackers(to.getRow(), to.getColumn(), opponent(), from.getRow(), from.getColumn()) == 0;
+      }
+      if (mr.capturedEnpassant) {
+        // Both pawns leave the row at once, which may uncover the king
+        // along it, so the resulting position is tested directly.
+        int add = current == Color::W ? 1 : -1;
+        BPiece * captured = b[to.getRow() + add][to.getColumn()];
+        b[to.getRow()][to.getColumn()] = bp;
+        b[from.getRow()][from.getColumn()] = nullptr;
+        b[to.getRow() + add][to.getColumn()] = nullptr;
+        uint64_t changed = square(from.getRow(), from.getColumn()) | square(to.getRow(), to.getColumn()) | square(to.getRow() + add, to.getColumn());
+        occupied ^= changed;
+        bool legal = attackers(ci.king.getRow(), ci.king.getColumn(), opponent()) == 0;
+        occupied ^= changed;
+        b[to.getRow() + add][to.getColumn()] = captured;
+        b[from.getRow()][from.getColumn()] = bp;
+        b[to.getRow()][to.getColumn()] = nullptr;
+        return legal;
+      }
+      uint64_t t = square(to.getRow(), to.getColumn());
+      if ((ci.checkMask & t) == 0) {
+        return false;
+      }
+      return (ci.pinned & square(from.getRow(), from.getColumn())) == 0 || (ci.pinLine[from.getRow() * 8 + from.getColumn()] & t) != 0;
+    }
+
+    /*
+     * Squares the piece at (row, column) may reach by its own rules,
+     * ignoring whether its king is left in check.
+     */
+    uint64_t pseudoTargets(int row, int column, BPiece* bp) {
+      uint64_t result = 0;
+      Piece p = bp->getPiece();
+      if (p == Piece::P) {
+        int add = current == Color::W ? -1 : 1;
+        int initialRow = current == Color::W ? 6 : 1;
+        int r = row + add;
+        if (!onBoard(r, column)) {
+          return result;
+        }
+        if (b[r][column] == nullptr) {
+          result |= square(r, column);
+          if (row == initialRow && b[r + add][column] == nullptr) {
+            result |= square(r + add, column);
+          }
+        }
+        uint64_t captures = squareTables.pawn[static_cast<int>(current)][row * 8 + column];
+        while (captures != 0) {
+          int s = __builtin_ctzll(captures);
+          captures &= captures - 1;
+          BPiece * op = b[s / 8][s % 8];
+          if ((op != nullptr && op->getColor() != current) || (op == nullptr && enPassant.getRow() == row && enPassant.getColumn() == s % 8)) {
+            result |= 1ULL << s;
+          }
+        }
+        return result;
+      }
+      if (p == Piece::H || p == Piece::K) {
+        uint64_t steps = p == Piece::H ? squareTables.horse[row * 8 + column] : squareTables.king[row * 8 + column];
+        while (steps != 0) {
+          int s = __builtin_ctzll(steps);
+          steps &= steps - 1;
+          if (b[s / 8][s % 8] == nullptr || b[s / 8][s % 8]->getColor() != current) {
+            result |= 1ULL << s;
+          }
+        }
+        int homeRow = current == Color::W ? 7 : 0;
+        if (p == Piece::K && row == homeRow && column == 4) {
+          result |= square(homeRow, 2) | square(homeRow, 6);
+        }
+        return result;
+      }
+      int first = p == Piece::B ? 4 : 0;
+      int last = p == Piece::R ? 4 : 8;
+      int s = row * 8 + column;
+      for (int d = first; d < last; d++) {
+        int t = firstBlocker(d, s, occupied);
+        result |= t == -1 ? squareTables.ray[d][s] : squareTables.ray[d][s] & ~squareTables.ray[d][t];
+        if (t != -1 && b[t / 8][t % 8]->getColor() == current) {
+          result &= ~(1ULL << t);
+        }
+      }
+      return result;
+    }
+  public:
+    Board() {
+
+      enPassant = Position(-1, -1);
+      current = Color::W; 
+
+      b[0][0] = new BPiece(Piece::R, Color::B);
+      b[0][1] = new BPiece(Piece::H, Color::B);
+      b[0][2] = new BPiece(Piece::B, Color::B);
+      b[0][3] = new BPiece(Piece::Q, Color::B);
+      b[0][4] = new BPiece(Piece::K, Color::B);
+      b[0][5] = new BPiece(Piece::B, Color::B);
+      b[0][6] = new BPiece(Piece::H, Color::B);
+      b[0][7] = new BPiece(Piece::R, Color::B);
+
+      b[1][0] = new BPiece(Piece::P, Color::B);
+      b[1][1] = new BPiece(Piece::P, Color::B);
+      b[1][2] = new BPiece(Piece::P, Color::B);
+      b[1][3] = new BPiece(Piece::P, Color::B);
+      b[1][4] = new BPiece(Piece::P, Color::B);
+      b[1][5] = new BPiece(Piece::P, Color::B);
+      b[1][6] = new BPiece(Piece::P, Color::B);
+      b[1][7] = new BPiece(Piece::P, Color::B);
+
+      b[2][0] = nullptr;
+      b[2][1] = nullptr;
+      b[2][2] = nullptr;
+      b[2][3] = nullptr;
+      b[2][4] = nullptr;
+      b[2][5] = nullptr;
+      b[2][6] = nullptr;
+      b[2][7] = nullptr;
+      
+      b[3][0] = nullptr;
+      b[3][1] = nullptr;
+      b[3][2] = nullptr;
+      b[3][3] = nullptr;
+      b[3][4] = nullptr;
+      b[3][5] = nullptr;
+      b[3][6] = nullptr;
       b[3][7] = nullptr;
       
       b[4][0] = nullptr;
@@ -204,6 +1642,36 @@ class Board {
       init();
     }
 
+    /*
+     * Board set up from a packed position, e.g. read from an archive.
+     */
+    Board(PositionView p) {
+      for (int s = 0; s < 64; s++) {
+        b[s / 8][s % 8] = nullptr;
+        if (!p.isEmpty(s)) {
+          b[s / 8][s % 8] = new BPiece(p.getPiece(s), p.getColor(s));
+          if (p.getPiece(s) == Piece::K) {
+            if (p.getColor(s) == Color::W) {
+              whiteKing = Position(s / 8, s % 8);
+            } else {
+              blackKing = Position(s / 8, s % 8);
+            }
+          }
+        }
+      }
+      current = p.getCurrent();
+      whiteKingMoved = p.getWhiteKingMoved();
+      whiteLeftRookMoved = p.getWhiteLeftRookMoved();
+      whiteRightRookMoved = p.getWhiteRightRookMoved();
+      blackKingMoved = p.getBlackKingMoved();
+      blackLeftRookMoved = p.getBlackLeftRookMoved();
+      blackRightRookMoved = p.getBlackRightRookMoved();
+      int ep = p.getEnpassant();
+      enPassant = ep == -1 ? Position(-1, -1) : Position(ep / 8, ep % 8);
+      halfmoveClock = p.getHalfmoveClock();
+      init();
+    }
+
     ~Board() {
       for (int i = 0; i < 8; i++) {
         for (int j = 0; j < 8; j++) {
@@ -212,6 +1680,9 @@ class Board {
 	    }
 	}
       }
+      for (UndoInfo& u : undos) {
+        delete u.captured;
+      }
     }
 
     MoveResult canMovePiece(Piece& p, Position& from, Position& to) {
@@ -279,7 +1750,20 @@ class Board {
       return b[p.getRow()][p.getColumn()];
     }
 
+    /*
+     * Are all the squares of mask empty?
+     */
+    bool isEmpty(uint64_t mask) {
+      return (mask & occupied) == 0;
+    }
+
+    /*
+     * The king and the rook must not have moved, the squares between
+     * them must be empty and the king must not be in check, pass
+     * through or land on an attacked square.
+     */
     bool canExecuteSmallCastle() {
+      INSTRUMENT(Operation::CanExecuteSmallCastle);
       bool moved = getCurrent() == Color::W ? getWhiteKingMoved() || getWhiteRightRookMoved() : getBlackKingMoved() || getBlackRightRookMoved();
       if (moved) {
 	 return false;
@@ -288,27 +1772,20 @@ class Board {
       if (getCurrent() == Color::W) {
         r = 7;
       }
-      for (int i = 0; i < 8; i++) {
-	for (int j = 0; j < 8; j++) {
-	  
-	  Position from = Position(i, j);
-	  BPiece * bp = b[i][j];
-	  if (bp != nullptr && bp->getColor() != getCurrent()) {
-	    current = getCurrent() == Color::W ? Color::B : Color::W;
-	    for (int c = 4; c <= 6; c++) { 
-		  Position to = Position(r, c);
-		  if ((i != r || j != c) && bp->canMove(this, from, to).canMove) {
-			  return false;
-		  }          
-	    }
-	    current = getCurrent() == Color::W ? Color::B : Color::W;
-	  }
-	}
+      BPiece * rook = b[r][7];
+      if (rook == nullptr || rook->getPiece() != Piece::R || rook->getColor() != current || b[r][5] != nullptr || b[r][6] != nullptr) {
+        return false;
+      }
+      for (int c = 4; c <= 6; c++) {
+        if (attackers(r, c, opponent()) != 0) {
+          return false;
+        }
       }
       return true;
     }
 
     bool canExecuteBigCastle() {
+      INSTRUMENT(Operation::CanExecuteBigCastle);
       bool moved = getCurrent() == Color::W ? getWhiteKingMoved() || getWhiteLeftRookMoved() : getBlackKingMoved() || getBlackLeftRookMoved();
       if (moved) {
 	 return false;
@@ -317,89 +1794,90 @@ class Board {
       if (getCurrent() == Color::W) {
         r = 7;
       }
-      for (int i = 0; i < 8; i++) {
-	for (int j = 0; j < 8; j++) {
-	  
-	  Position from = Position(i, j);
-	  BPiece * bp = b[i][j];
-	  if (bp != nullptr && bp->getColor() != getCurrent()) {
-	    current = getCurrent() == Color::W ? Color::B : Color::W;
-	    for (int c = 2; c <= 4; c++) { 
-		  Position to = Position(r, c);
-		  if ((i != r || j != c) && bp->canMove(this, from, to).canMove) {
-                    return false;
-		  }          
-	    }
-	    current = getCurrent() == Color::W ? Color::B : Color::W;
-	  }
-	}
+      BPiece * rook = b[r][0];
+      if (rook == nullptr || rook->getPiece() != Piece::R || rook->getColor() != current || b[r][1] != nullptr || b[r][2] != nullptr || b[r][3] != nullptr) {
+        return false;
+      }
+      for (int c = 2; c <= 4; c++) {
+        if (attackers(r, c, opponent()) != 0) {
+          return false;
+        }
       }
       return true;
     }
-    
+
+    /*
+     * Validates a move of the current player without making it.
+     */
     bool canMove(Position fP, Position tP) {
+      INSTRUMENT(Operation::CanMove);
       if (fP.getRow() == tP.getRow() && fP.getColumn() == tP.getColumn()) {
         return false;
       }
-      
-	BPiece* bcopy[8][8];
-	for (int i = 0; i < 8; i++) {
-	  for (int j = 0; j < 8; j++) {
-	    bcopy[i][j] = b[i][j];
-	  }
-	}
+      BPiece * bp = get(fP);
+      if (bp == nullptr || bp->getColor() != current) {
+        return false;
+      }
+      MoveResult mr = bp->canMove(this, fP, tP);
+      if (!mr.canMove) {
+        return false;
+      }
+      CheckInfo ci = checkInfo();
+      return isLegal(ci, fP, tP, mr);
+    }
 
-	BPiece * bp = b[fP.getRow()][fP.getColumn()];
-	MoveResult mr = bp->canMove(this, fP, tP);
-	bool result = mr.canMove;
-	if (result) {
-	  if (mr.capturedEnpassant) {
-	    int add = current == Color::W ? 1 : -1;
-	    b[tP.getRow() + add][tP.getColumn()] = nullptr;
-	  } 
-	  if (mr.smallCastle) {
-            if (current == Color::W) {
-              b[7][6] = b[7][4];
-  	      b[7][4] = nullptr;
-	      b[7][5] = b[7][7];
-              b[7][7] = nullptr;      
-	    } else {	     
-              b[0][6] = b[0][4];
-  	      b[0][4] = nullptr;
-	      b[0][5] = b[0][7];
-              b[0][7] = nullptr;      
-	    }	    
-	  } else if (mr.bigCastle) {
-            if (current == Color::W) {
-              b[7][2] = b[7][4];
-  	      b[7][4] = nullptr;
-	      b[7][3] = b[7][0];
-              b[7][0] = nullptr;      
-	    } else {	     
-              b[0][2] = b[0][4];
-  	      b[0][4] = nullptr;
-	      b[0][3] = b[0][0];
-              b[0][0] = nullptr;      
-	    }	    
-	  } else {	  
-	    b[tP.getRow()][tP.getColumn()] = b[fP.getRow()][fP.getColumn()];
-            b[fP.getRow()][fP.getColumn()] = nullptr;
-	  }
-	  result = !isCurrentInCheck();
-	}
-        
-	    for (int i = 0; i < 8; i++) {
-	      for (int j = 0; j < 8; j++) {
-	        b[i][j] = bcopy[i][j];
-	      }
-	    }
-	return result;
+    /*
+     * Generates the legal moves of the current player. Passing nullptr
+     * stops at the first legal move, which is all checkmate detection
+     * needs. Returns whether the current player has any legal move.
+     */
+    bool legalMoves(vector<Move>* moves) {
+      CheckInfo ci = checkInfo();
+      bool found = false;
+      for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+          BPiece * bp = b[i][j];
+          if (bp == nullptr || bp->getColor() != current) {
+            continue;
+          }
+          Piece p = bp->getPiece();
+          uint64_t targets = pseudoTargets(i, j, bp);
+          if (p != Piece::K && p != Piece::P) {
+            targets &= ci.checkMask;
+            if ((ci.pinned & square(i, j)) != 0) {
+              targets &= ci.pinLine[i * 8 + j];
+            }
+          }
+          Position from = Position(i, j);
+          while (targets != 0) {
+            int s = __builtin_ctzll(targets);
+            targets &= targets - 1;
+            Position to = Position(s / 8, s % 8);
+            if (p == Piece::K || p == Piece::P) {
+              MoveResult mr = bp->canMove(this, from, to);
+              if (!mr.canMove || !isLegal(ci, from, to, mr)) {
+                continue;
+              }
+            }
+            found = true;
+            if (moves == nullptr) {
+              return true;
+            }
+            moves->push_back(Move(from, to));
+          }
+        }
+      }
+      return found;
     }
 
     Result move(string from, string to) {
+	INSTRUMENT(Operation::Move);
 	if (checkmate) {
 	  throw logic_error("Checkmate! The game is over! No more move allowed!");
 	}
+	if (draw != Draw::None) {
+	  throw logic_error("Draw! The game is over! No more move allowed!");
+	}
         if (promotion.getRow() != -1) {
 	   throw logic_error("Promotion needs to be executed first!");
 	}	
@@ -415,446 +1893,1968 @@ class Board {
 	if (bp->getColor() != current) {
 	  throw logic_error("From position is not the current player!");
 	}
-	// copying is required because the current player is not allowed
-	// to but itself in check. So we make the move, verify if it is
-	// in check, if true we restore the board.
-    
-	BPiece* bcopy[8][8];
-	for (int i = 0; i < 8; i++) {
-	  for (int j = 0; j < 8; j++) {
-	    bcopy[i][j] = b[i][j];
-	  }
+	// the move is validated against check and pins before it is made,
+	// so the board never needs to be restored.
+	MoveResult mr = bp->canMove(this, fP, tP);
+	if (!mr.canMove) {
+	  return Result(false, false, false, false);
+	}
+	CheckInfo ci = checkInfo();
+	if (!isLegal(ci, fP, tP, mr)) {
+	  return Result(false, false, false, false);
 	}
+        UndoInfo u;
+        u.from = fP.getSquare();
+        u.to = tP.getSquare();
+        u.piece = bp->getPiece();
+        u.current = current;
+        u.enPassant = enPassant;
+        u.moved = whiteKingMoved | whiteLeftRookMoved << 1 | whiteRightRookMoved << 2
+            | blackKingMoved << 3 | blackLeftRookMoved << 4 | blackRightRookMoved << 5;
+        u.whiteKing = whiteKing;
+        u.blackKing = blackKing;
+        u.pieceHash = pieceHash;
+        u.occupied = occupied;
+        copy(&pieceCount[0][0], &pieceCount[0][0] + 12, &u.pieceCount[0][0]);
+        u.halfmoveClock = halfmoveClock;
+        // squares a piece arrived on or left, the only sources of a check
+        // against the opponent once the move is made.
+        int arrived = tP.getRow() * 8 + tP.getColumn();
+        int vacated[2] = {fP.getRow() * 8 + fP.getColumn(), -1};
+        if (mr.smallCastle) {
+          arrived = fP.getRow() * 8 + 5;
+          vacated[1] = fP.getRow() * 8 + 7;
+        } else if (mr.bigCastle) {
+          arrived = fP.getRow() * 8 + 3;
+          vacated[1] = fP.getRow() * 8;
+        } else if (mr.capturedEnpassant) {
+          vacated[1] = arrived + (current == Color::W ? 8 : -8);
+        }
+        if (bp->getPiece() == Piece::K) {
+          if (current == Color::W) {
+            whiteKing = tP;
+          } else {
+            blackKing = tP;
+          }
+        }
+        BPiece * captured = nullptr;
+        int capturedSquare = tP.getSquare();
+        if (mr.capturedEnpassant) {
+          capturedSquare = vacated[1];
+          captured = b[capturedSquare / 8][capturedSquare % 8];
+        } else if (!mr.smallCastle && !mr.bigCastle) {
+          captured = get(tP);
+        }
+        if (captured != nullptr) {
+          toggle(captured, capturedSquare);
+          pieceCount[static_cast<int>(captured->getColor())][static_cast<int>(captured->getPiece())]--;
+        }
+        toggle(bp, fP.getSquare());
+        toggle(bp, tP.getSquare());
+        if (mr.smallCastle || mr.bigCastle) {
+          BPiece * rook = b[vacated[1] / 8][vacated[1] % 8];
+          toggle(rook, vacated[1]);
+          toggle(rook, arrived);
+          u.rookFrom = vacated[1];
+          u.rookTo = arrived;
+        }
+        halfmoveClock = captured != nullptr || bp->getPiece() == Piece::P ? 0 : halfmoveClock + 1;
+        played.push_back(packMove(fP.getSquare(), tP.getSquare(), 0));
+        enPassant = Position(-1, -1);
+        if (mr.enpassant) {
+          enPassant = Position(tP.getRow(), tP.getColumn());
+        } else if (mr.capturedEnpassant) {
+          int add = current == Color::W ? 1 : -1;
+          b[tP.getRow() + add][tP.getColumn()] = nullptr;
+        }
+        if (mr.smallCastle) {
+          if (current == Color::W) {
+            b[7][6] = b[7][4];
+            b[7][4] = nullptr;
+            b[7][5] = b[7][7];
+            b[7][7] = nullptr;
+          } else {
+            b[0][6] = b[0][4];
+            b[0][4] = nullptr;
+            b[0][5] = b[0][7];
+            b[0][7] = nullptr;
+          }
 
-	MoveResult mr = bp->canMove(this, fP, tP);
-	if (mr.canMove) {
-	  enPassant = Position(-1, -1);
-	  if (mr.enpassant) {
-	    enPassant = Position(tP.getRow(), tP.getColumn());
-	  } else if (mr.capturedEnpassant) {
-	    int add = current == Color::W ? 1 : -1;
-	    b[tP.getRow() + add][tP.getColumn()] = nullptr;
-	  } 
-	  if (mr.smallCastle) {
-            if (current == Color::W) {
-              b[7][6] = b[7][4];
-  	      b[7][4] = nullptr;
-	      b[7][5] = b[7][7];
-              b[7][7] = nullptr;     
-	    } else {	     
-              b[0][6] = b[0][4];
-  	      b[0][4] = nullptr;
-	      b[0][5] = b[0][7];
-              b[0][7] = nullptr;     
-	    }	
-
-	  } else if (mr.bigCastle) {
-            if (current == Color::W) {
-              b[7][2] = b[7][4];
-  	      b[7][4] = nullptr;
-	      b[7][3] = b[7][0];
-              b[7][0] = nullptr;      
-	    } else {	     
-              b[0][2] = b[0][4];
-  	      b[0][4] = nullptr;
-	      b[0][3] = b[0][0];
-              b[0][0] = nullptr;      
-	    }	    
-	  } else {	  
-	    b[tP.getRow()][tP.getColumn()] = b[fP.getRow()][fP.getColumn()];
-            b[fP.getRow()][fP.getColumn()] = nullptr;
-	  }
-	  if (mr.promotion) {
-	    promotion = Position(tP.getRow(), tP.getColumn());
+        } else if (mr.bigCastle) {
+          if (current == Color::W) {
+            b[7][2] = b[7][4];
+            b[7][4] = nullptr;
+            b[7][3] = b[7][0];
+            b[7][0] = nullptr;
+          } else {
+            b[0][2] = b[0][4];
+            b[0][4] = nullptr;
+            b[0][3] = b[0][0];
+            b[0][0] = nullptr;
+          }
+        } else {
+          b[tP.getRow()][tP.getColumn()] = b[fP.getRow()][fP.getColumn()];
+          b[fP.getRow()][fP.getColumn()] = nullptr;
+        }
+        // the board no longer points to the captured piece, undo() puts
+        // it back.
+        u.captured = captured;
+        u.capturedSquare = capturedSquare;
+        undos.push_back(u);
+        if (mr.promotion) {
+          promotion = Position(tP.getRow(), tP.getColumn());
+        }
+        if (getCurrent() == Color::W && !getWhiteKingMoved() && fP.getRow() == 7 && fP.getColumn() == 4) {
+          setWhiteKingMoved();
+        }
+
+        if (getCurrent() == Color::W && !getWhiteLeftRookMoved() && fP.getRow() == 7 && fP.getColumn() == 0) {
+          setWhiteLeftRookMoved();
+        }
+
+        if (getCurrent() == Color::W && !getWhiteRightRookMoved() && fP.getRow() == 7 && fP.getColumn() == 7) {
+          setWhiteRightRookMoved();
+        }
+
+        if (getCurrent() == Color::B && !getBlackKingMoved() && fP.getRow() == 0 && fP.getColumn() == 4) {
+          setBlackKingMoved();
+        }
+
+        if (getCurrent() == Color::B && !getBlackLeftRookMoved() && fP.getRow() == 0 && fP.getColumn() == 0) {
+          setBlackLeftRookMoved();
+        }
+
+        if (getCurrent() == Color::B && !getBlackRightRookMoved() && fP.getRow() == 0 && fP.getColumn() == 7) {
+          setBlackRightRookMoved();
+        }
+
+        // a piece landing on a corner captured the rook still at home, or
+        // the rook left it before: either way that castling right is gone.
+        if (tP.getRow() == 7 && tP.getColumn() == 0) {
+          setWhiteLeftRookMoved();
+        } else if (tP.getRow() == 7 && tP.getColumn() == 7) {
+          setWhiteRightRookMoved();
+        } else if (tP.getRow() == 0 && tP.getColumn() == 0) {
+          setBlackLeftRookMoved();
+        } else if (tP.getRow() == 0 && tP.getColumn() == 7) {
+          setBlackRightRookMoved();
+        }
+        // the move is legal, so change the current.
+        current = current == Color::W ? Color::B : Color::W;
+        Position king = findKing(current);
+        bool discovered = uncoversKing(vacated[0], king) || (vacated[1] != -1 && uncoversKing(vacated[1], king));
+        bool check = discovered || attacksKing(arrived, king);
+        if (mr.promotion) {
+          promotionDiscoveredCheck = discovered;
+        }
+        history.push_back(getHash());
+	checkmate = isCurrentInCheckmate(check);
+	// with a promotion pending the position is not final yet, promote()
+	// decides the draw.
+	if (!checkmate && !mr.promotion) {
+	  draw = drawStatus(check);
+	}
+	return Result(mr.promotion, check, checkmate, true, draw);
+    }
+
+    /*
+     * Takes back the last move, a pending or made promotion included.
+     */
+    void undo() {
+      if (undos.empty()) {
+        throw logic_error("There is no move to undo!");
+      }
+      UndoInfo& u = undos.back();
+      BPiece * bp = b[u.to / 8][u.to % 8];
+      bp->setPiece(u.piece);
+      b[u.to / 8][u.to % 8] = nullptr;
+      b[u.from / 8][u.from % 8] = bp;
+      if (u.rookFrom != -1) {
+        b[u.rookFrom / 8][u.rookFrom % 8] = b[u.rookTo / 8][u.rookTo % 8];
+        b[u.rookTo / 8][u.rookTo % 8] = nullptr;
+      }
+      if (u.captured != nullptr) {
+        b[u.capturedSquare / 8][u.capturedSquare % 8] = u.captured;
+      }
+      current = u.current;
+      enPassant = u.enPassant;
+      whiteKingMoved = u.moved & 1;
+      whiteLeftRookMoved = u.moved >> 1 & 1;
+      whiteRightRookMoved = u.moved >> 2 & 1;
+      blackKingMoved = u.moved >> 3 & 1;
+      blackLeftRookMoved = u.moved >> 4 & 1;
+      blackRightRookMoved = u.moved >> 5 & 1;
+      whiteKing = u.whiteKing;
+      blackKing = u.blackKing;
+      pieceHash = u.pieceHash;
+      occupied = u.occupied;
+      copy(&u.pieceCount[0][0], &u.pieceCount[0][0] + 12, &pieceCount[0][0]);
+      halfmoveClock = u.halfmoveClock;
+      // move() refuses to play on a finished game or a pending promotion.
+      promotion = Position(-1, -1);
+      promotionDiscoveredCheck = false;
+      checkmate = false;
+      draw = Draw::None;
+      history.pop_back();
+      played.pop_back();
+      undos.pop_back();
+    }
+
+    bool isCurrentInCheck() {
+      INSTRUMENT(Operation::IsCurrentInCheck);
+      Position p = findKing(current);
+      return attackers(p.getRow(), p.getColumn(), opponent()) != 0;
+    }
+
+    /*
+     * Current is in checkmate if it cannot move any of its piece.
+     */
+    bool isCurrentInCheckmate(bool check) {
+      INSTRUMENT(Operation::IsCurrentInCheckmate);
+      if (!check) {
+        return false;
+      }
+      return !legalMoves(nullptr);
+    }
+
+    /*
+     * When promote is called the current player has already been changed.
+     * So the current player is the one that needs to be verified against 
+     * check/checkmate.
+     */
+    Result promote(Piece p) {
+      if (p != Piece::Q && p != Piece::R && p != Piece::H && p != Piece::B) {
+         throw logic_error("Promotion needs to be to Queuen, Rook, Knight or Bishop!");
+      }
+      if (promotion.getRow() == -1) {
+        throw logic_error("There is no pawn to be promoted!");
+      }
+      BPiece * bp = get(promotion);
+      int color = static_cast<int>(bp->getColor());
+      toggle(bp, promotion.getSquare());
+      pieceCount[color][static_cast<int>(Piece::P)]--;
+      pieceCount[color][static_cast<int>(p)]++;
+      bp->setPiece(p);
+      toggle(bp, promotion.getSquare());
+      history.back() = getHash();
+      played.back() |= static_cast<int>(p) << 12;
+      Position king = findKing(current);
+      bool check = promotionDiscoveredCheck || attacksKing(promotion.getRow() * 8 + promotion.getColumn(), king);
+      promotion = Position(-1, -1);
+      checkmate = isCurrentInCheckmate(check);
+      if (!checkmate) {
+        draw = drawStatus(check);
+      }
+      return Result(false, check, checkmate, true, draw);
+    }
+
+    void print() {
+      for (int i = 0; i < 8; i++) {
+	cout << 8 - i << " ";
+	for (int j = 0; j < 8; j++) {
+	  BPiece* p = b[i][j];
+	  if (p == nullptr) {
+	    cout << "." << " ";
+	    continue;
 	  }
-	  // Verify if current put itself in check, in case true, restore the board from the copy.
-	  if (isCurrentInCheck()) {
-	    for (int i = 0; i < 8; i++) {
-	      for (int j = 0; j < 8; j++) {
-	        b[i][j] = bcopy[i][j];
-	      }
+	  if (p->getColor() == Color::W) {
+	    if (p->getPiece() == Piece::K) {
+	      cout << "\u2654" << " ";
 	    }
-	    promotion = Position(-1, -1);
-	    enPassant = Position(-1, -1);
-
-	    return Result(false, false, false, false);
+	    if (p->getPiece() == Piece::Q) {
+	      cout << "\u2655" << " ";
+	    }
+	    if (p->getPiece() == Piece::R) {
+	      cout << "\u2656" << " ";
+	    }
+	    if (p->getPiece() == Piece::B) {
+	      cout << "\u2657" << " ";
+	    }
+	    if (p->getPiece() == Piece::H) {
+              cout << "\u2658" << " ";
+	    } 
+	    if (p->getPiece() == Piece::P) {
+              cout << "\u2659" << " ";
+	    }
+	  } else {
+            if (p->getPiece() == Piece::K) {
+	      cout << "\u265A" << " ";
+	    }
+	    if (p->getPiece() == Piece::Q) {
+	      cout << "\u265B" << " ";
+	    }
+	    if (p->getPiece() == Piece::R) {
+	      cout << "\u265C" << " ";
+	    }
+	    if (p->getPiece() == Piece::B) {
+	      cout << "\u265D" << " ";
+	    }
+	    if (p->getPiece() == Piece::H) {
+              cout << "\u265E" << " ";
+	    } 
+	    if (p->getPiece() == Piece::P) {
+              cout << "\u265F" << " ";
+	    } 
+	  }
+	}
+	cout << '\n';
+      }
+      cout << "  ";
+      for (char c = 'a'; c <= 'h'; c++) {
+	      cout << c << " ";
+      }
+      cout << '\n';
+    }
+
+    Color getCurrent() {
+      return current;
+    }
+
+    Draw getDraw() {
+      return draw;
+    }
+
+    static string squareName(Position p) {
+      return string(1, 'a' + p.getColumn()) + string(1, '8' - p.getRow());
+    }
+
+    /*
+     * Polyglot key of the position. Like getHash(), en passant only counts
+     * when the current player has a pawn next to the pawn to capture.
+     */
+    uint64_t getPolyglotKey() {
+      uint64_t key = 0;
+      for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+          BPiece * bp = b[i][j];
+          if (bp != nullptr) {
+            int kind = polyglotKinds[static_cast<int>(bp->getPiece())] + (bp->getColor() == Color::W ? 1 : 0);
+            key ^= polyglotRandom[64 * kind + 8 * (7 - i) + j];
+          }
+        }
+      }
+      int rights = castleRights();
+      for (int i = 0; i < 4; i++) {
+        if ((rights >> i & 1) != 0) {
+          key ^= polyglotRandom[768 + i];
+        }
+      }
+      if (enPassantCapturable()) {
+        key ^= polyglotRandom[772 + enPassant.getColumn()];
+      }
+      if (current == Color::W) {
+        key ^= polyglotRandom[780];
+      }
+      return key;
+    }
+
+    /*
+     * Book moves of the current position that are legal here, castling
+     * translated to the king move. Empty when the position is not in the book.
+     */
+    vector<BookMove> probeBook(Book& book) {
+      vector<BookMove> moves;
+      if (promotion.getRow() != -1) {
+        return moves;
+      }
+      for (BookMove m : book.probe(getPolyglotKey())) {
+        BPiece * bp = get(m.from);
+        BPiece * target = get(m.to);
+        if (bp != nullptr && bp->getPiece() == Piece::K && target != nullptr && target->getColor() == bp->getColor() && target->getPiece() == Piece::R) {
+          m.to = Position(m.to.getRow(), m.to.getColumn() == 7 ? 6 : 2);
+        }
+        bool pawnToLastRow = bp != nullptr && bp->getPiece() == Piece::P && (m.to.getRow() == 0 || m.to.getRow() == 7);
+        if (pawnToLastRow == (m.promotion != Piece::K) && canMove(m.from, m.to)) {
+          moves.push_back(m);
+        }
+      }
+      return moves;
+    }
+
+    /*
+     * Writes the position in the 32 byte packed format.
+     */
+    void pack(uint8_t* out) {
+      if (promotion.getRow() != -1) {
+        throw logic_error("Promotion needs to be executed first!");
+      }
+      uint8_t codes[64];
+      for (int s = 0; s < 64; s++) {
+        BPiece * bp = b[s / 8][s % 8];
+        codes[s] = bp == nullptr ? 0xFF : static_cast<int>(bp->getPiece()) | (bp->getColor() == Color::W ? 8 : 0);
+      }
+      uint8_t flags = (current == Color::B) | whiteKingMoved << 1 | whiteLeftRookMoved << 2 | whiteRightRookMoved << 3
+          | blackKingMoved << 4 | blackLeftRookMoved << 5 | blackRightRookMoved << 6;
+      packPosition(codes, flags, enPassant.getRow() == -1 ? -1 : enPassant.getSquare(), halfmoveClock, out);
+    }
+
+    /*
+     * Appends the game played so far on this board in the packed game format.
+     */
+    void packGame(vector<uint8_t>& out) {
+      out.insert(out.end(), start, start + packedPositionSize);
+      out.push_back(played.size() & 0xFF);
+      out.push_back(played.size() >> 8);
+      for (uint16_t m : played) {
+        out.push_back(m & 0xFF);
+        out.push_back(m >> 8);
+      }
+    }
+
+    int getHalfmoveClock() {
+      return halfmoveClock;
+    }
+
+    /*
+     * Hashes of the positions since the game started, the current one last.
+     */
+    vector<uint64_t> getHistory() {
+      return history;
+    }
+
+    /*
+     * Hash of the position: pieces, castling rights, the side to move and
+     * the en passant column when the current player has a pawn next to
+     * the pawn that may be captured.
+     */
+    uint64_t getHash() {
+      uint64_t h = pieceHash ^ zobristKeys.castle[castleRights()];
+      if (current == Color::B) {
+        h ^= zobristKeys.black;
+      }
+      if (enPassantCapturable()) {
+        h ^= zobristKeys.enPassant[enPassant.getColumn()];
+      }
+      return h;
+    }
+};
+
+
+class PawnMoveCalculator : public MoveCalculator {
+  public:
+    /*
+     * 1. Pawn can move only forward in the same column, except when
+     * capturing a piece, it can move one square in diagonal to left
+     * or to right. In addition, en passant, allows a pawn to capture
+     * a pawn that is beside it, when the pawn being captured moved for
+     * the first time two squares at once.
+     * 2. Pawn can move only one square at a time, except the first move
+     * allows a Pawn to move two squares.
+     */
+    MoveResult canMove(Board* board, Position& from, Position& to) override {
+      int add = board->getCurrent() == Color::W ? -1 : 1;
+      bool promotion = to.getRow() == 0 || to.getRow() == 7;
+      if (to.getColumn() == from.getColumn()) {
+        // can move one position?
+        Position one = Position(from.getRow() + add, from.getColumn());
+        if (to.getRow() == one.getRow()) {
+          return MoveResult(board->get(one) == nullptr, promotion, false, false, false, false);
+        }
+        // can move two positions?
+        int initialRow = board->getCurrent() == Color::W ? 6 : 1;
+        bool canMove = from.getRow() == initialRow && to.getRow() == from.getRow() + 2 * add && board->get(one) == nullptr && board->get(to) == nullptr;
+        return MoveResult(canMove, false, canMove, false, false, false);
+      }
+      // can capture?
+      if ((squareTables.pawn[static_cast<int>(board->getCurrent())][from.getSquare()] & (1ULL << to.getSquare())) == 0) {
+        return MoveResult(false, false, false, false, false, false);
+      }
+      BPiece * c = board->get(to);
+      if (c != nullptr) {
+        return MoveResult(c->getColor() != board->getCurrent(), promotion, false, false, false, false);
+      }
+      // enpassant
+      Position enPassant = board->getEnpassant();
+      return MoveResult(enPassant.getRow() == from.getRow() && enPassant.getColumn() == to.getColumn(), false, false, true, false, false);
+    }
+};
+
+class BishopMoveCalculator : public MoveCalculator {
+  public:
+    MoveResult canMove(Board* board, Position& from, Position& to) override {
+      if ((squareTables.bishop[from.getSquare()] & (1ULL << to.getSquare())) == 0 || !board->isEmpty(squareTables.between[from.getSquare()][to.getSquare()])) {
+        return MoveResult(false, false, false, false, false, false);
+      }
+      BPiece * bp = board->get(to);
+      return MoveResult(bp == nullptr || bp->getColor() != board->getCurrent(), false, false, false, false, false);
+    }
+};
+
+class HorseMoveCalculator : public MoveCalculator {
+  public:
+    MoveResult canMove(Board* board, Position& from, Position& to) override {
+      if ((squareTables.horse[from.getSquare()] & (1ULL << to.getSquare())) == 0) {
+        return MoveResult(false, false, false, false, false, false);
+      }
+      BPiece * bp = board->get(to);
+      return MoveResult(bp == nullptr || bp->getColor() != board->getCurrent(), false, false, false, false, false);
+    }
+};
+
+class KingMoveCalculator : public MoveCalculator {
+  public:
+    MoveResult canMove(Board* board, Position& from, Position& to) override {
+      if ((squareTables.king[from.getSquare()] & (1ULL << to.getSquare())) != 0) {
+        BPiece * bp = board->get(to);
+        return MoveResult(bp == nullptr || bp->getColor() != board->getCurrent(), false, false, false, false, false);
+      }
+
+      if (board->getCurrent() == Color::W && to.getRow() == 7 && to.getColumn() == 6 && board->canExecuteSmallCastle()) {
+	      return MoveResult(true, false, false, false, true, false);
+      }
+
+      if (board->getCurrent() == Color::W && to.getRow() == 7 && to.getColumn() == 2 && board->canExecuteBigCastle()) {
+        return MoveResult(true, false, false, false, false, true);
+      }
+
+      if (board->getCurrent() == Color::B && to.getRow() == 0 && to.getColumn() == 6 && board->canExecuteSmallCastle()) {
+        return MoveResult(true, false, false, false, true, false);
+      }
+
+      if (board->getCurrent() == Color::B && to.getRow() == 0 && to.getColumn() == 2 && board->canExecuteBigCastle()) {
+        return MoveResult(true, false, false, false, false, true);
+      }
+      return MoveResult(false, false, false, false, false, false);
+    }
+};
+
+
+class RookMoveCalculator : public MoveCalculator {
+  public:
+    MoveResult canMove(Board* board, Position& from, Position& to) override {
+      if ((squareTables.rook[from.getSquare()] & (1ULL << to.getSquare())) == 0 || !board->isEmpty(squareTables.between[from.getSquare()][to.getSquare()])) {
+        return MoveResult(false, false, false, false, false, false);
+      }
+      BPiece * bp = board->get(to);
+      return MoveResult(bp == nullptr || bp->getColor() != board->getCurrent(), false, false, false, false, false);
+    }
+};
+
+class QueenMoveCalculator : public MoveCalculator {
+  public:
+    MoveResult canMove(Board* board, Position& from, Position& to) override {
+      BishopMoveCalculator b;
+      MoveResult mr = b.canMove(board, from, to);
+      if (mr.canMove) {
+        return mr;
+      }
+      RookMoveCalculator r;
+      return r.canMove(board, from, to);
+    }
+};
+
+void Board::init() {
+      // the calculators keep no state, so every board shares them.
+      static PawnMoveCalculator pawn;
+      static BishopMoveCalculator bishop;
+      static HorseMoveCalculator horse;
+      static RookMoveCalculator rook;
+      static QueenMoveCalculator queen;
+      static KingMoveCalculator king;
+      calculators[Piece::P] = &pawn;
+      calculators[Piece::B] = &bishop;
+      calculators[Piece::H] = &horse;
+      calculators[Piece::R] = &rook;
+      calculators[Piece::Q] = &queen;
+      calculators[Piece::K] = &king;
+      for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+          if (b[i][j] != nullptr) {
+            toggle(b[i][j], i * 8 + j);
+            pieceCount[static_cast<int>(b[i][j]->getColor())][static_cast<int>(b[i][j]->getPiece())]++;
+          }
+        }
+      }
+      history.push_back(getHash());
+      pack(start);
+}
+
+/*
+ * Picks one of the moves with a probability proportional to its weight,
+ * random being any uniformly distributed number. moves must not be empty.
+ */
+BookMove chooseBookMove(vector<BookMove>& moves, uint64_t random) {
+  uint64_t total = 0;
+  for (BookMove& m : moves) {
+    total += m.weight;
+  }
+  if (total == 0) {
+    return moves[random % moves.size()];
+  }
+  uint64_t r = random % total;
+  for (BookMove& m : moves) {
+    if (r < static_cast<uint64_t>(m.weight)) {
+      return m;
+    }
+    r -= m.weight;
+  }
+  return moves.back();
+}
+
+/*
+ * Writes a Polyglot book at path from the first maxPly moves of every
+ * game of a packed game archive, each move weighted by how often it was
+ * played in its position.
+ */
+void buildBook(GameReader games, int maxPly, string path) {
+  map<pair<uint64_t, uint16_t>, int> counts;
+  const int promotions[6] = {0, 4, 3, 1, 2, 0};
+  while (games.hasNext()) {
+    GameView game = games.next();
+    Board board(game.getStart());
+    for (int i = 0; i < game.getMoveCount() && i < maxPly; i++) {
+      uint16_t m = game.getMove(i);
+      Position from = Position((m & 63) / 8, m & 7);
+      Position to = Position((m >> 6 & 63) / 8, m >> 6 & 7);
+      int promotion = m >> 12 & 7;
+      uint64_t key = board.getPolyglotKey();
+      BPiece * bp = board.get(from);
+      int bookTo = to.getColumn();
+      if (bp->getPiece() == Piece::K && abs(to.getColumn() - from.getColumn()) == 2) {
+        // Polyglot writes castling as the king taking its rook.
+        bookTo = to.getColumn() == 6 ? 7 : 0;
+      }
+      uint16_t bookMove = bookTo | (7 - to.getRow()) << 3 | from.getColumn() << 6 | (7 - from.getRow()) << 9 | promotions[promotion] << 12;
+      counts[make_pair(key, bookMove)]++;
+      Result r = board.move(Board::squareName(from), Board::squareName(to));
+      if (r.promotion) {
+        r = board.promote(static_cast<Piece>(promotion));
+      }
+      if (r.checkmate || r.draw != Draw::None) {
+        break;
+      }
+    }
+  }
+  vector<uint8_t> out;
+  for (auto& entry : counts) {
+    writeBigEndian(entry.first.first, 8, out);
+    writeBigEndian(entry.first.second, 2, out);
+    writeBigEndian(min(entry.second, 0xFFFF), 2, out);
+    writeBigEndian(0, 4, out);
+  }
+  ofstream f(path, ios::binary);
+  f.write(reinterpret_cast<const char*>(out.data()), out.size());
+  if (!f) {
+    throw logic_error("Cannot write " + path + "!");
+  }
+}
+
+/*
+ * Fixed benchmark corpus: openings, middlegames, endgames, positions in
+ * or full of checks and positions with promotions pending.
+ */
+const char* benchmarkCorpus[] = {
+  "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+  "rnbqkb1r/pppp1ppp/5n2/4p3/2B1P3/8/PPPP1PPP/RNBQK1NR w KQkq - 2 3",
+  "r1bqkbnr/pppp1ppp/2n5/1B2p3/4P3/5N2/PPPP1PPP/RNBQK2R b KQkq - 3 3",
+  "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+  "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+  "r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP3PPP/R2QKB1R w KQ - 0 8",
+  "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+  "8/8/4k3/8/2K5/8/3Q4/8 w - - 0 1",
+  "8/5pk1/6p1/8/3R4/6P1/5PK1/r7 b - - 0 40",
+  "rnb1kbnr/pppp1ppp/8/4p3/6Pq/5P2/PPPPP2P/RNBQKBNR w KQkq - 1 3",
+  "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+  "4k3/8/8/8/8/8/4r3/R3K2R w KQ - 0 1",
+  "rnbqk1nr/pppp1ppp/8/4p3/1b1P4/8/PPP1PPPP/RNBQKBNR w KQkq - 1 3",
+  "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+  "8/P1P2P1k/8/8/4K3/8/1p1p2p1/8 w - - 0 1",
+  "3r4/2P3k1/8/8/8/8/5Kp1/8 b - - 0 1",
+};
+
+/*
+ * Times the referee over the corpus. The operations take turns for
+ * repetitions rounds and each keeps its fastest round, which is the
+ * least disturbed by the rest of the machine, and its slowest round as
+ * a measure of the noise. Results are in nanoseconds per call.
+ */
+class Benchmark {
+    vector<array<uint8_t, packedPositionSize>> positions;
+    // position index and from and to squares of every legal move.
+    vector<pair<int, pair<string, string>>> moves;
+    vector<Board*> boards;
+    int copies;
+    long calls[operationCount];
+    double nsPerCall[operationCount];
+    double slowestNsPerCall[operationCount];
+    // results are added here so the calls cannot be optimized away.
+    volatile uint64_t sink = 0;
+
+    template <typename F>
+    double elapsed(F run) {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      run();
+      return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    }
+
+    void keep(Operation op, long n, double ns) {
+      int o = static_cast<int>(op);
+      if (calls[o] == 0 || ns / n < nsPerCall[o]) {
+        nsPerCall[o] = ns / n;
+      }
+      if (calls[o] == 0 || ns / n > slowestNsPerCall[o]) {
+        slowestNsPerCall[o] = ns / n;
+      }
+      calls[o] = n;
+    }
+
+    template <typename F>
+    void time(Operation op, long n, F run) {
+      keep(op, n, elapsed(run));
+    }
+
+    /*
+     * Every legal move is made copies times, each on a fresh board set up
+     * just before the clock starts, a copy of the corpus at a time so the
+     * boards are still in the cache.
+     */
+    void timeMoves() {
+      double ns = 0;
+      for (int c = 0; c < copies; c++) {
+        vector<Board*> fresh;
+        for (auto& m : moves) {
+          fresh.push_back(new Board(PositionView(positions[m.first].data())));
+        }
+        ns += elapsed([&]() {
+          for (size_t i = 0; i < moves.size(); i++) {
+            sink += fresh[i]->move(moves[i].second.first, moves[i].second.second).check;
+          }
+        });
+        for (Board* b : fresh) {
+          delete b;
+        }
+      }
+      keep(Operation::Move, static_cast<long>(moves.size()) * copies, ns);
+    }
+
+    /*
+     * Times f, called iterations times on the board of every position.
+     */
+    template <typename F>
+    void timeBoards(Operation op, int iterations, F f) {
+      time(op, static_cast<long>(boards.size()) * iterations, [&]() {
+        for (Board* b : boards) {
+          for (int i = 0; i < iterations; i++) {
+            sink += f(b);
+          }
+        }
+      });
+    }
+
+    /*
+     * Board::canMove and the calculators are asked, iterations times,
+     * about every target square of every piece of the current player.
+     */
+    void timeTargets(int iterations) {
+      vector<pair<Board*, Position>> pieces[6];
+      vector<pair<Board*, Position>> all;
+      for (Board* b : boards) {
+        for (int s = 0; s < 64; s++) {
+          Position from = Position(s / 8, s % 8);
+          BPiece * bp = b->get(from);
+          if (bp != nullptr && bp->getColor() == b->getCurrent()) {
+            pieces[static_cast<int>(bp->getPiece())].push_back(make_pair(b, from));
+            all.push_back(make_pair(b, from));
+          }
+        }
+      }
+      time(Operation::CanMove, static_cast<long>(all.size()) * 64 * iterations, [&]() {
+        for (int i = 0; i < iterations; i++) {
+          for (auto& p : all) {
+            for (int t = 0; t < 64; t++) {
+              sink += p.first->canMove(p.second, Position(t / 8, t % 8));
+            }
+          }
+        }
+      });
+      for (int k = 0; k < 6; k++) {
+        Piece piece = static_cast<Piece>(k);
+        time(static_cast<Operation>(static_cast<int>(Operation::KingMoveCalculator) + k), static_cast<long>(pieces[k].size()) * 63 * iterations, [&]() {
+          for (int i = 0; i < iterations; i++) {
+            for (auto& p : pieces[k]) {
+              for (int t = 0; t < 64; t++) {
+                Position to = Position(t / 8, t % 8);
+                if (t != p.second.getSquare()) {
+                  sink += p.first->canMovePiece(piece, p.second, to).canMove;
+                }
+              }
+            }
+          }
+        });
+      }
+    }
+
+  public:
+    /*
+     * Every legal move is made copies times per round, so that a round
+     * of moves lasts long enough to be timed.
+     */
+    Benchmark(int copies = 20) {
+      this->copies = copies;
+      for (const char* fen : benchmarkCorpus) {
+        array<uint8_t, packedPositionSize> p;
+        packFen(fen, p.data());
+        positions.push_back(p);
+      }
+      for (size_t i = 0; i < positions.size(); i++) {
+        Board* board = new Board(PositionView(positions[i].data()));
+        vector<Move> legal;
+        board->legalMoves(&legal);
+        for (Move& m : legal) {
+          moves.push_back(make_pair(i, make_pair(Board::squareName(m.getFrom()), Board::squareName(m.getTo()))));
+        }
+        boards.push_back(board);
+      }
+      for (int o = 0; o < operationCount; o++) {
+        calls[o] = 0;
+        nsPerCall[o] = 0;
+        slowestNsPerCall[o] = 0;
+      }
+    }
+
+    ~Benchmark() {
+      for (Board* b : boards) {
+        delete b;
+      }
+    }
+
+    void run(int repetitions) {
+      const int iterations = 1000;
+      for (int r = 0; r < repetitions; r++) {
+        timeMoves();
+        timeBoards(Operation::IsCurrentInCheck, iterations, [](Board* b) {
+          return b->isCurrentInCheck();
+        });
+        // asked as if in check, so the sweep for a legal move always runs.
+        timeBoards(Operation::IsCurrentInCheckmate, iterations, [](Board* b) {
+          return b->isCurrentInCheckmate(true);
+        });
+        timeBoards(Operation::CanExecuteSmallCastle, iterations, [](Board* b) {
+          return b->canExecuteSmallCastle();
+        });
+        timeBoards(Operation::CanExecuteBigCastle, iterations, [](Board* b) {
+          return b->canExecuteBigCastle();
+        });
+        timeTargets(iterations / 10);
+      }
+    }
+
+    double getNsPerCall(Operation op) {
+      return nsPerCall[static_cast<int>(op)];
+    }
+
+    void writeJson(ostream& out) {
+      out << "{\"positions\": " << positions.size() << ", \"operations\": {";
+      for (int o = 0; o < operationCount; o++) {
+        out << (o == 0 ? "" : ", ") << "\n  \"" << operationNames[o] << "\": {\"calls\": " << calls[o] << ", \"nsPerCall\": " << nsPerCall[o]
+            << ", \"slowestNsPerCall\": " << slowestNsPerCall[o] << '}';
+      }
+      out << "\n}}" << '\n';
+    }
+
+    /*
+     * Reads the fastest nanoseconds per call of every operation back from
+     * a baseline written by writeJson.
+     */
+    static map<string, double> readJson(istream& in) {
+      string json((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+      map<string, double> baseline;
+      for (int o = 0; o < operationCount; o++) {
+        size_t p = json.find("\"" + string(operationNames[o]) + "\"");
+        size_t v = p == string::npos ? p : json.find("\"nsPerCall\":", p);
+        if (v == string::npos) {
+          throw logic_error("Baseline misses " + string(operationNames[o]) + "!");
+        }
+        baseline[operationNames[o]] = stod(json.substr(v + 12));
+      }
+      return baseline;
+    }
+
+    /*
+     * Prints every operation against the baseline, fastest round against
+     * fastest round; the slowest round is only shown as the noise of this
+     * run. Returns false when one got slower by more than threshold percent.
+     */
+    bool compare(map<string, double>& baseline, double threshold, ostream& out) {
+      bool ok = true;
+      for (int o = 0; o < operationCount; o++) {
+        double before = baseline[operationNames[o]];
+        double change = before == 0 ? 0 : (nsPerCall[o] - before) / before * 100;
+        bool regression = change > threshold;
+        ok = ok && !regression;
+        out << operationNames[o] << ": " << before << " -> " << nsPerCall[o] << " ns (" << (change >= 0 ? "+" : "") << change << "%, slowest round "
+            << slowestNsPerCall[o] << ")" << (regression ? " REGRESSION" : "") << '\n';
+      }
+      return ok;
+    }
+};
+
+/*
+ * A perft reference: the number of leaf nodes of the legal move tree of
+ * a position at a depth.
+ */
+class PerftCase {
+  public:
+    const char* fen;
+    int depth;
+    long nodes;
+};
+
+/*
+ * The start position, Kiwipete and positions 3 to 6 of the usual perft
+ * suite, full of castles, en passant, promotions and pins.
+ */
+const PerftCase perftSuite[] = {
+  {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 4, 197281},
+  {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 3, 97862},
+  {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5, 674624},
+  {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 3, 9467},
+  {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 3, 62379},
+  {"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 3, 89890},
+};
+
+/*
+ * Counts the leaf nodes of the legal move tree of a packed position to
+ * depth, a promotion counting once per piece. Every move is made and
+ * taken back on one board: after the move its check and incremental hash
+ * must match those of a board set up from scratch on the position reached
+ * and its packed game must replay to the same packed position, after
+ * undo() the board must pack and hash as before the move.
+ */
+long perft(const uint8_t* position, int depth) {
+  const Piece promotions[4] = {Piece::Q, Piece::R, Piece::H, Piece::B};
+  PositionView view(position);
+  Board board(view);
+  vector<Move> moves;
+  board.legalMoves(&moves);
+  uint64_t parentHash = board.getHash();
+  long nodes = 0;
+  for (Move& m : moves) {
+    string from = Board::squareName(m.getFrom()), to = Board::squareName(m.getTo());
+    for (int k = 0; k < 4; k++) {
+      Result r = board.move(from, to);
+      if (!r.canMove) {
+        throw logic_error("Legal move " + from + to + " was rejected!");
+      }
+      bool promotion = r.promotion;
+      if (promotion) {
+        r = board.promote(promotions[k]);
+      }
+      uint8_t packed[packedPositionSize];
+      board.pack(packed);
+      Board fresh((PositionView(packed)));
+      if (r.check != fresh.isCurrentInCheck() || board.getHash() != fresh.getHash()) {
+        throw logic_error("Incremental check or hash is wrong after " + from + to + "!");
+      }
+      vector<uint8_t> game;
+      board.packGame(game);
+      GameReplay replay = GameReplay(GameView(game.data()));
+      replay.next();
+      uint8_t replayed[packedPositionSize];
+      replay.pack(replayed);
+      if (!equal(packed, packed + packedPositionSize, replayed)) {
+        throw logic_error("Replaying the packed game differs from the board after " + from + to + "!");
+      }
+      board.undo();
+      uint8_t undone[packedPositionSize];
+      board.pack(undone);
+      if (!equal(position, position + packedPositionSize, undone) || board.getHash() != parentHash) {
+        throw logic_error("Taking back " + from + to + " does not restore the position!");
+      }
+      nodes += depth == 1 ? 1 : perft(packed, depth - 1);
+      if (!promotion) {
+        break;
+      }
+    }
+  }
+  return nodes;
+}
+
+/*
+ * A position reached during the mate search, with its packed position,
+ * the move leading to it and its proof and disproof numbers. Children
+ * ending the game are final: a checkmate of the defender is proven, a
+ * draw or a checkmate of the attacker disproven.
+ */
+class MateNode {
+  public:
+    uint8_t position[packedPositionSize];
+    uint64_t hash;
+    uint16_t move;
+    uint32_t pn;
+    uint32_t dn;
+    // plies to mate once proven.
+    int distance;
+    bool final;
+};
+
+/*
+ * Entry of the node store: the proof and disproof numbers of a position
+ * with a number of plies left, the plies of the mate found once proven,
+ * and the nodes it took to get them.
+ */
+class MateEntry {
+  public:
+    uint64_t key = 0;
+    uint32_t pn = 0;
+    uint32_t dn = 0;
+    int distance = 0;
+    uint64_t work = 0;
+};
+
+class MateSolution {
+  public:
+    bool mate = false;
+    // false when the node limit stopped the search before an answer.
+    bool complete = true;
+    int moves = 0;
+    vector<string> line;
+    long nodes = 0;
+};
+
+/*
+ * Proves or disproves a forced mate in a number of moves with depth-first
+ * proof-number search (df-pn). Positions are kept packed; a node is
+ * expanded on a Board set up from it, making and taking back each move,
+ * so the rules and the checkmate and draw detection are Board's own.
+ * Proof and disproof numbers are kept in a fixed size node store, keyed
+ * by position and plies left; when a bucket is full the entry that took
+ * the least work is replaced. The children of the nodes on the search
+ * path are allocated from a fixed arena, released as the search returns.
+ */
+class MateSolver {
+    static const uint32_t infinity = 1u << 30;
+    static const int bucketSize = 4;
+
+    vector<MateEntry> store;
+    vector<MateNode> arena;
+    size_t top = 0;
+    long nodes = 0;
+    long maxNodes;
+    bool stopped = false;
+
+    static uint64_t keyOf(uint64_t hash, int plies) {
+      uint64_t state = plies;
+      return hash ^ splitMix64(state);
+    }
+
+    static uint32_t add(uint32_t a, uint32_t b) {
+      return a + b >= infinity ? infinity : a + b;
+    }
+
+    void lookup(uint64_t key, uint32_t& pn, uint32_t& dn, int& distance) {
+      size_t first = key & (store.size() - bucketSize);
+      for (size_t i = first; i < first + bucketSize; i++) {
+        if (store[i].key == key) {
+          pn = store[i].pn;
+          dn = store[i].dn;
+          distance = store[i].distance;
+          return;
+        }
+      }
+      pn = 1;
+      dn = 1;
+      distance = 0;
+    }
+
+    void save(uint64_t key, uint32_t pn, uint32_t dn, int distance, uint64_t work) {
+      size_t first = key & (store.size() - bucketSize);
+      size_t replace = first;
+      for (size_t i = first; i < first + bucketSize; i++) {
+        if (store[i].key == key) {
+          replace = i;
+          break;
+        }
+        if (store[i].work < store[replace].work) {
+          replace = i;
+        }
+      }
+      store[replace].key = key;
+      store[replace].pn = pn;
+      store[replace].dn = dn;
+      store[replace].distance = distance;
+      store[replace].work = work;
+    }
+
+    /*
+     * Makes every legal move of position on top of the arena. attacker
+     * tells whether the player to move is the one giving mate. Returns
+     * the number of children.
+     */
+    int expand(const uint8_t* position, bool attacker) {
+      Board board{PositionView(position)};
+      vector<Move> moves;
+      board.legalMoves(&moves);
+      size_t first = top;
+      const Piece promotions[4] = {Piece::Q, Piece::R, Piece::H, Piece::B};
+      for (Move& m : moves) {
+        Position from = m.getFrom();
+        Position to = m.getTo();
+        for (int k = 0; k < 4; k++) {
+          if (top == arena.size()) {
+            throw logic_error("Solver arena exhausted!");
+          }
+          Result r = board.move(Board::squareName(from), Board::squareName(to));
+          int promotion = 0;
+          if (r.promotion) {
+            r = board.promote(promotions[k]);
+            promotion = static_cast<int>(promotions[k]);
+          }
+          MateNode& n = arena[top++];
+          board.pack(n.position);
+          n.hash = board.getHash();
+          board.undo();
+          n.move = packMove(from.getSquare(), to.getSquare(), promotion);
+          n.final = r.checkmate || r.draw != Draw::None;
+          n.pn = r.checkmate && attacker ? 0 : infinity;
+          n.dn = r.checkmate && attacker ? infinity : 0;
+          n.distance = 0;
+          if (promotion == 0) {
+            break;
+          }
+        }
+      }
+      return top - first;
+    }
+
+    /*
+     * The multiple iterative deepening loop of df-pn, in the phi/delta
+     * form: phi is the proof number of a node where the attacker moves
+     * and the disproof number where the defender does, delta the other
+     * one. Searches below the node until phi reaches thPhi or delta
+     * reaches thDelta, then leaves its numbers in pn and dn, and when
+     * proven the plies of the mate in distance.
+     */
+    void mid(const uint8_t* position, uint64_t hash, bool attacker, int plies, uint32_t thPhi, uint32_t thDelta, uint32_t& pn, uint32_t& dn, int& distance) {
+      nodes++;
+      long before = nodes;
+      size_t first = top;
+      int count = expand(position, attacker);
+      for (size_t i = first; i < top; i++) {
+        MateNode& c = arena[i];
+        if (c.final) {
+          continue;
+        }
+        if (plies == 1) {
+          // the last ply: whatever is not mate yet has escaped.
+          c.pn = infinity;
+          c.dn = 0;
+        } else {
+          lookup(keyOf(c.hash, plies - 1), c.pn, c.dn, c.distance);
+        }
+      }
+      uint32_t phi = infinity, delta = 0;
+      while (true) {
+        // phi is the smallest of the children's deltas, delta the sum of
+        // their phis.
+        phi = infinity;
+        delta = 0;
+        uint32_t second = infinity;
+        size_t best = first;
+        for (size_t i = first; i < top; i++) {
+          uint32_t childDelta = attacker ? arena[i].pn : arena[i].dn;
+          uint32_t childPhi = attacker ? arena[i].dn : arena[i].pn;
+          delta = add(delta, childPhi);
+          if (childDelta < phi) {
+            second = phi;
+            phi = childDelta;
+            best = i;
+          } else if (childDelta < second) {
+            second = childDelta;
+          }
+        }
+        if (count == 0) {
+          // no move without the game ending before, so only at the root.
+          phi = attacker ? infinity : 0;
+          delta = attacker ? 0 : infinity;
+        }
+        if (phi >= thPhi || delta >= thDelta || stopped) {
+          break;
+        }
+        if (nodes >= maxNodes) {
+          stopped = true;
+          break;
+        }
+        MateNode& c = arena[best];
+        uint32_t childPhi = attacker ? c.dn : c.pn;
+        uint32_t childThPhi = thDelta - delta + childPhi;
+        uint32_t childThDelta = min(thPhi, second + 1);
+        // the arena never grows, so c stays put while the child is searched.
+        mid(c.position, c.hash, !attacker, plies - 1, childThPhi, childThDelta, c.pn, c.dn, c.distance);
+      }
+      pn = attacker ? phi : delta;
+      dn = attacker ? delta : phi;
+      distance = 0;
+      if (pn == 0) {
+        // the attacker takes the quickest proven child, the defender
+        // holds out longest.
+        distance = attacker ? plies : 0;
+        for (size_t i = first; i < top; i++) {
+          if (arena[i].pn == 0) {
+            distance = attacker ? min(distance, arena[i].distance + 1) : max(distance, arena[i].distance + 1);
+          }
+        }
+      }
+      top = first;
+      save(keyOf(hash, plies), pn, dn, distance, nodes - before + 1);
+    }
+
+    /*
+     * Whether the attacker mates within plies from the packed position.
+     */
+    bool prove(const uint8_t* position, uint64_t hash, bool attacker, int plies, int& distance) {
+      uint32_t pn = 1, dn = 1;
+      lookup(keyOf(hash, plies), pn, dn, distance);
+      while (pn != 0 && dn != 0 && !stopped) {
+        mid(position, hash, attacker, plies, infinity, infinity, pn, dn, distance);
+      }
+      return pn == 0;
+    }
+
+    /*
+     * Plies of the mate after the move to the child, or -1 if not within
+     * plies. Taken from the node store, where the proof of the parent
+     * left it, so only a child whose entry was replaced is searched again.
+     */
+    int distance(MateNode& c, bool attacker, int plies) {
+      if (c.final) {
+        return c.pn == 0 ? 0 : -1;
+      }
+      if (plies == 0) {
+        return -1;
+      }
+      int d = 0;
+      return prove(c.position, c.hash, attacker, plies, d) ? d : -1;
+    }
 
-	  } else {
-	    
-	    if (getCurrent() == Color::W && !getWhiteKingMoved() && fP.getRow() == 7 && fP.getColumn() == 4) {
-              setWhiteKingMoved();
-	    }
+    static string moveName(uint16_t m) {
+      string name = Board::squareName(Position((m & 63) / 8, m & 7)) + Board::squareName(Position((m >> 6 & 63) / 8, m >> 6 & 7));
+      int promotion = m >> 12 & 7;
+      if (promotion != 0) {
+        name += "KQRHBP"[promotion];
+      }
+      return name;
+    }
 
-	    if (getCurrent() == Color::W && !getWhiteLeftRookMoved() && fP.getRow() == 7 && fP.getColumn() == 0) {
-              setWhiteLeftRookMoved();
-	    }	    
-		  
-	    if (getCurrent() == Color::W && !getWhiteRightRookMoved() && fP.getRow() == 7 && fP.getColumn() == 7) {
-              setWhiteRightRookMoved();
-	    }
+  public:
+    /*
+     * memory is the size of the node store in bytes, maxNodes bounds the
+     * nodes searched by a solve.
+     */
+    MateSolver(size_t memory = 64 << 20, long maxNodes = 10000000) {
+      size_t entries = bucketSize;
+      while (entries * 2 * sizeof(MateEntry) <= memory) {
+        entries *= 2;
+      }
+      store.resize(entries);
+      this->maxNodes = maxNodes;
+    }
 
-	    if (getCurrent() == Color::B && !getBlackKingMoved() && fP.getRow() == 0 && fP.getColumn() == 4) {
-              setBlackKingMoved();
-	    }	    
-	    
-	    if (getCurrent() == Color::B && !getBlackLeftRookMoved() && fP.getRow() == 0 && fP.getColumn() == 0) {
-              setBlackLeftRookMoved();
-	    }	    
-	    
-	    if (getCurrent() == Color::B && !getBlackRightRookMoved() && fP.getRow() == 0 && fP.getColumn() == 7) {
-              setBlackRightRookMoved();
-	    }	    
-	    // current is not in check, so we can allow the move and change the current.
-            current = current == Color::W ? Color::B : Color::W;
-	  }
-          	  
-	}
-	bool check = isCurrentInCheck();
-	checkmate = isCurrentInCheckmate(check);
-	return Result(mr.promotion, check, checkmate, true);
+    /*
+     * Looks for a mate of the current player in at most moves moves,
+     * trying the shorter mates first. The line alternates the attacker's
+     * quickest mating moves with the defender's longest resistance, as
+     * measured by the mates the proof found.
+     */
+    MateSolution solve(const uint8_t* position, int moves) {
+      MateSolution solution;
+      Board root{PositionView(position)};
+      uint64_t hash = root.getHash();
+      arena.assign((2 * moves + 2) * 256, MateNode());
+      top = 0;
+      nodes = 0;
+      stopped = false;
+      for (int n = 1; n <= moves && !solution.mate; n++) {
+        int d = 0;
+        if (prove(position, hash, true, 2 * n - 1, d)) {
+          solution.mate = true;
+          solution.moves = n;
+        }
+      }
+      if (solution.mate) {
+        uint8_t current[packedPositionSize];
+        copy(position, position + packedPositionSize, current);
+        bool attacker = true;
+        for (int plies = 2 * solution.moves - 1; plies > 0 && !stopped; plies--) {
+          size_t first = top;
+          expand(current, attacker);
+          size_t chosen = first;
+          int chosenDistance = -1;
+          for (size_t i = first; i < top; i++) {
+            int d = distance(arena[i], !attacker, plies - 1);
+            if (d == -1) {
+              continue;
+            }
+            if (chosenDistance == -1 || (attacker ? d < chosenDistance : d > chosenDistance)) {
+              chosen = i;
+              chosenDistance = d;
+            }
+          }
+          solution.line.push_back(moveName(arena[chosen].move));
+          copy(arena[chosen].position, arena[chosen].position + packedPositionSize, current);
+          top = first;
+          if (chosenDistance == 0) {
+            break;
+          }
+          attacker = !attacker;
+        }
+      }
+      solution.complete = !stopped;
+      solution.nodes = nodes;
+      return solution;
     }
+};
 
-    bool isCurrentInCheck() {
-      int row = -1;
-      int col = -1;
-      for (int i = 0; i < 8; i++) {
-        for (int j = 0; j < 8; j++) {
-	  BPiece * bp = b[i][j];
-	  if (bp != nullptr && bp->getColor() == getCurrent() && bp->getPiece() == Piece::K) {
-	    row = i;
-            col = j;
-		  break;
-	  }
-	}
+/*
+ * Settings of a selfplay engine, comma separated key=value pairs: nodes
+ * and time (in milliseconds) bound every move, zero meaning no bound,
+ * depth bounds the iterative deepening and center weighs how central the
+ * pieces stand.
+ */
+class EngineConfig {
+  public:
+    long nodes = 0;
+    int time = 0;
+    int depth = 64;
+    int center = 5;
+    EngineConfig() {
+    }
+    EngineConfig(string settings) {
+      istringstream in(settings);
+      string setting;
+      while (getline(in, setting, ',')) {
+        size_t eq = setting.find('=');
+        string key = setting.substr(0, eq);
+        long value = eq == string::npos ? -1 : atol(setting.substr(eq + 1).c_str());
+        if (value < 0) {
+          throw logic_error("Invalid engine setting " + setting + "!");
+        }
+        if (key == "nodes") {
+          nodes = value;
+        } else if (key == "time") {
+          time = value;
+        } else if (key == "depth") {
+          depth = value;
+        } else if (key == "center") {
+          center = value;
+        } else {
+          throw logic_error("Invalid engine setting " + setting + "!");
+        }
       }
-      Position p = Position(row, col);
-      for (int i = 0; i < 8; i++) {
-        for (int j = 0; j < 8; j++) {
-	   Position r = Position(i, j);
-	   BPiece * bp = get(r);
-	   if (bp != nullptr && bp->getColor() != getCurrent()) {
-		   current = getCurrent() == Color::W ? Color::B : Color::W;
-		   bool canMove = bp->canMove(this, r, p).canMove;
-		   current = getCurrent() == Color::W ? Color::B : Color::W; 
-		   if (canMove) {
-    	     return true;	   
-		   }
-	   } 
-	}
+      if (nodes == 0 && time == 0 && depth == 64) {
+        throw logic_error("Engine needs a nodes, time or depth bound!");
       }
+    }
+};
 
-      return false;
+const int pieceValues[6] = {0, 900, 500, 320, 330, 100};
+
+/*
+ * Alpha-beta engine used by selfplay: iterative deepening negamax with a
+ * capture-only quiescence search over material, pawn advancement and
+ * centralization. Like the mate solver it keeps positions packed and
+ * makes its moves on Boards, so it plays by Board's rules; a position
+ * the game already went through counts as a draw. Pawns are only
+ * promoted to queens.
+ */
+class Engine {
+    static const int mate = 100000;
+    EngineConfig config;
+    long nodes = 0;
+    bool stopped = false;
+    chrono::steady_clock::time_point deadline;
+    // hashes of the positions of the game so far, sorted.
+    vector<uint64_t> history;
+
+    /*
+     * Score of the position for the player to move.
+     */
+    int evaluate(PositionView p) {
+      int score = 0;
+      uint64_t occupancy = p.getOccupancy();
+      while (occupancy != 0) {
+        int s = __builtin_ctzll(occupancy);
+        occupancy &= occupancy - 1;
+        int r = s / 8, c = s % 8;
+        Piece piece = p.getPiece(s);
+        bool white = p.getColor(s) == Color::W;
+        int value = pieceValues[static_cast<int>(piece)];
+        if (piece == Piece::P) {
+          value += 10 * (white ? 6 - r : r - 1);
+        } else if (piece != Piece::K) {
+          value += config.center * (7 - (abs(2 * r - 7) + abs(2 * c - 7)) / 2);
+        }
+        score += white ? value : -value;
+      }
+      return p.getCurrent() == Color::W ? score : -score;
+    }
+
+    bool outOfBudget() {
+      nodes++;
+      if ((config.nodes != 0 && nodes > config.nodes) || (config.time != 0 && (nodes & 255) == 0 && chrono::steady_clock::now() > deadline)) {
+        stopped = true;
+      }
+      return stopped;
     }
 
     /*
-     * Current is in checkmate if it cannot move any of its piece.
+     * Captures first, the most valuable victims first.
      */
-    bool isCurrentInCheckmate(bool check) {
-      if (!check) {
-        return false;
+    void order(Board& board, vector<Move>& moves) {
+      vector<pair<int, int>> keys;
+      for (size_t i = 0; i < moves.size(); i++) {
+        Position to = moves[i].getTo();
+        BPiece * victim = board.get(to);
+        keys.push_back(make_pair(victim == nullptr ? 0 : -pieceValues[static_cast<int>(victim->getPiece())], i));
       }
-      for (int i = 0; i < 8; i++) {
-        for (int j = 0; j < 8; j++) {
-	  Position p = Position(i, j);
-	  BPiece *bp = get(p);
-	  if (bp != nullptr && bp->getColor() == getCurrent()) {
-            for (int r = 0; r < 8; r++) {
-	      for (int c = 0; c < 8; c++) {
-	        Position to = Position(r, c);
-		BPiece * op = get(to);
-		if (op == nullptr || op->getColor() != getCurrent()) {
-		  bool result = canMove(p, to);
-		  if (result) {
-		    return false;
-		  }
-		}
-	      }
-	    }	    
-	  }
-	}
+      stable_sort(keys.begin(), keys.end());
+      vector<Move> ordered;
+      for (auto& k : keys) {
+        ordered.push_back(moves[k.second]);
       }
-      return true;
+      moves = ordered;
     }
 
     /*
-     * When promote is called the current player has already been changed.
-     * So the current player is the one that needs to be verified against 
-     * check/checkmate.
+     * Makes the move, leaving the packed child in child. Returns the
+     * move's Result with a draw recorded when the child repeats a
+     * position of the game.
      */
-    Result promote(Piece p) {
-      if (p != Piece::Q && p != Piece::R && p != Piece::H && p != Piece::B) {
-         throw logic_error("Promotion needs to be to Queuen, Rook, Knight or Bishop!");
+    Result play(const uint8_t* position, Move& m, uint8_t* child) {
+      Board board{PositionView(position)};
+      Result r = board.move(Board::squareName(m.getFrom()), Board::squareName(m.getTo()));
+      if (r.promotion) {
+        r = board.promote(Piece::Q);
       }
-      if (promotion.getRow() == -1) {
-        throw logic_error("There is no pawn to be promoted!");
+      board.pack(child);
+      if (!r.checkmate && binary_search(history.begin(), history.end(), board.getHash())) {
+        r.draw = Draw::Repetition;
       }
-      BPiece * bp = get(promotion);
-      bp->setPiece(p);
-      promotion = Position(-1, -1);
-      bool check = isCurrentInCheck();
-      return Result(false, check, isCurrentInCheckmate(check), true);
+      return r;
     }
 
-    void print() {
-      for (int i = 0; i < 8; i++) {
-	cout << 8 - i << " ";
-	for (int j = 0; j < 8; j++) {
-	  BPiece* p = b[i][j];
-	  if (p == nullptr) {
-	    cout << "." << " ";
-	    continue;
-	  }
-	  if (p->getColor() == Color::W) {
-	    if (p->getPiece() == Piece::K) {
-	      cout << "\u2654" << " ";
-	    }
-	    if (p->getPiece() == Piece::Q) {
-	      cout << "\u2655" << " ";
-	    }
-	    if (p->getPiece() == Piece::R) {
-	      cout << "\u2656" << " ";
-	    }
-	    if (p->getPiece() == Piece::B) {
-	      cout << "\u2657" << " ";
-	    }
-	    if (p->getPiece() == Piece::H) {
-              cout << "\u2658" << " ";
-	    } 
-	    if (p->getPiece() == Piece::P) {
-              cout << "\u2659" << " ";
-	    }
-	  } else {
-            if (p->getPiece() == Piece::K) {
-	      cout << "\u265A" << " ";
-	    }
-	    if (p->getPiece() == Piece::Q) {
-	      cout << "\u265B" << " ";
-	    }
-	    if (p->getPiece() == Piece::R) {
-	      cout << "\u265C" << " ";
-	    }
-	    if (p->getPiece() == Piece::B) {
-	      cout << "\u265D" << " ";
-	    }
-	    if (p->getPiece() == Piece::H) {
-              cout << "\u265E" << " ";
-	    } 
-	    if (p->getPiece() == Piece::P) {
-              cout << "\u265F" << " ";
-	    } 
-	  }
-	}
-	cout << '\n';
+    /*
+     * Score of a move made from a position ply plies below the root.
+     */
+    int score(Result& r, const uint8_t* child, int depth, int alpha, int beta, int ply) {
+      if (r.checkmate) {
+        return mate - ply - 1;
       }
-      cout << "  ";
-      for (char c = 'a'; c <= 'h'; c++) {
-	      cout << c << " ";
+      if (r.draw != Draw::None) {
+        return 0;
       }
-      cout << '\n';
+      return depth <= 1 ? -quiesce(child, -beta, -alpha, ply + 1) : -search(child, depth - 1, -beta, -alpha, ply + 1);
     }
 
-    Color getCurrent() {
-      return current;
+    int quiesce(const uint8_t* position, int alpha, int beta, int ply) {
+      if (outOfBudget()) {
+        return 0;
+      }
+      int best = evaluate(PositionView(position));
+      if (best >= beta) {
+        return best;
+      }
+      alpha = max(alpha, best);
+      Board board{PositionView(position)};
+      vector<Move> moves;
+      board.legalMoves(&moves);
+      order(board, moves);
+      for (Move& m : moves) {
+        Position to = m.getTo();
+        if (board.get(to) == nullptr) {
+          break;
+        }
+        uint8_t child[packedPositionSize];
+        Result r = play(position, m, child);
+        int s = r.checkmate ? mate - ply - 1 : r.draw != Draw::None ? 0 : -quiesce(child, -beta, -alpha, ply + 1);
+        if (stopped) {
+          return 0;
+        }
+        best = max(best, s);
+        alpha = max(alpha, s);
+        if (alpha >= beta) {
+          break;
+        }
+      }
+      return best;
     }
-};
 
+    int search(const uint8_t* position, int depth, int alpha, int beta, int ply) {
+      if (outOfBudget()) {
+        return 0;
+      }
+      Board board{PositionView(position)};
+      vector<Move> moves;
+      board.legalMoves(&moves);
+      order(board, moves);
+      int best = -mate;
+      for (Move& m : moves) {
+        uint8_t child[packedPositionSize];
+        Result r = play(position, m, child);
+        int s = score(r, child, depth, alpha, beta, ply);
+        if (stopped) {
+          return 0;
+        }
+        best = max(best, s);
+        alpha = max(alpha, s);
+        if (alpha >= beta) {
+          break;
+        }
+      }
+      return best;
+    }
 
-class PawnMoveCalculator : public MoveCalculator {
   public:
+    Engine(EngineConfig config) {
+      this->config = config;
+    }
+
     /*
-     * 1. Pawn can move only forward in the same column, except when
-     * capturing a piece, it can move one square in diagonal to left
-     * or to right. In addition, en passant, allows a pawn to capture
-     * a pawn that is beside it, when the pawn being captured moved for
-     * the first time two squares at once.
-     * 2. Pawn can move only one square at a time, except the first move
-     * allows a Pawn to move two squares.
+     * Best move of the current player, who must have one, found within
+     * the budget. Each iteration starts from the best move of the last
+     * one and only a finished iteration changes the choice, except the
+     * first, which has nothing to fall back on.
      */
-    MoveResult canMove(Board* board, Position& from, Position& to) override {
-      // can move one position?
-      int add = board->getCurrent() == Color::W ? -1 : 1;
-      Position one = Position(from.getRow() + add, from.getColumn());
-      BPiece* bp = board->get(one);
-      if (bp == nullptr && to.getRow() == one.getRow() && to.getColumn() == one.getColumn()) {
-        return MoveResult(true, to.getRow() == 0 || to.getRow() == 7, false, false, false, false);
-      }
-      // can move two positions?
-      Position two = Position(from.getRow() + 2 * add, from.getColumn());
-      BPiece * bpTwo = board->get(two);
-      int initialRow = board->getCurrent() == Color::W ? 6 : 1;
-      if (bp == nullptr && bpTwo == nullptr && from.getRow() == initialRow && to.getRow() == two.getRow() && to.getColumn() == two.getColumn()) {
-        return MoveResult(true, false, true, false, false, false);
+    Move choose(Board& board) {
+      uint8_t root[packedPositionSize];
+      board.pack(root);
+      history = board.getHistory();
+      sort(history.begin(), history.end());
+      nodes = 0;
+      stopped = false;
+      deadline = chrono::steady_clock::now() + chrono::milliseconds(config.time);
+      vector<Move> moves;
+      board.legalMoves(&moves);
+      order(board, moves);
+      size_t best = 0;
+      for (int depth = 1; depth <= config.depth; depth++) {
+        int alpha = -mate - 1;
+        size_t iterationBest = 0;
+        for (size_t i = 0; i < moves.size(); i++) {
+          uint8_t child[packedPositionSize];
+          Result r = play(root, moves[i], child);
+          int s = score(r, child, depth, alpha, mate + 1, 0);
+          if (stopped) {
+            break;
+          }
+          if (s > alpha) {
+            alpha = s;
+            iterationBest = i;
+          }
+        }
+        if (stopped && depth > 1) {
+          break;
+        }
+        best = iterationBest;
+        rotate(moves.begin(), moves.begin() + best, moves.begin() + best + 1);
+        best = 0;
+        if (stopped || alpha >= mate - depth) {
+          break;
+        }
       }
-      // can capture?
-      if (from.getColumn() - 1 >= 0) {
-        Position cap = Position(from.getRow() + add, from.getColumn() - 1);
-	BPiece * c = board->get(cap);
-	if (c != nullptr && c->getColor() != board->getCurrent() && to.getRow() == cap.getRow() && to.getColumn() == cap.getColumn()) {
-	  return MoveResult(true, to.getRow() == 0 || to.getRow() == 7, false, false, false, false);
-	}
-	// enpassant
-	if (c == nullptr && to.getRow() == cap.getRow() && to.getColumn() == cap.getColumn()) {
-	  Position enPassant = board->getEnpassant();
-	  return MoveResult(enPassant.getRow() != -1 && enPassant.getRow() == from.getRow() && enPassant.getColumn() == from.getColumn() - 1, false, false, true, false, false);
-	}
+      return moves[best];
+    }
+};
+
+/*
+ * Balanced openings selfplay starts from, each played with both colors,
+ * when no suite is given.
+ */
+const char* selfPlayOpenings[] = {
+  "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+  "rnbqkbnr/pppp1ppp/8/4p3/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2",
+  "rnbqkbnr/pp1ppppp/8/2p5/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2",
+  "rnbqkbnr/pppp1ppp/4p3/8/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2",
+  "rnbqkbnr/pp1ppppp/2p5/8/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2",
+  "rnbqkbnr/ppp1pppp/8/3p4/3P4/8/PPP1PPPP/RNBQKBNR w KQkq - 0 2",
+  "rnbqkb1r/pppppppp/5n2/8/3P4/8/PPP1PPPP/RNBQKBNR w KQkq - 1 2",
+  "rnbqkbnr/pppppppp/8/8/2P5/8/PP1PPPPP/RNBQKBNR b KQkq - 0 1",
+};
+
+/*
+ * Plays games between two engines on worker threads, one game at a time
+ * per thread, each opening once with either engine moving first. Games
+ * end on Board's checkmate and draw results, or as draws after
+ * maxPlies. After every game a sequential probability ratio test of elo1
+ * against elo0 for the first engine may stop the match.
+ */
+class SelfPlay {
+    static const int sprtMinGames = 16;
+    EngineConfig first;
+    EngineConfig second;
+    vector<array<uint8_t, packedPositionSize>> openings;
+    int games;
+    int maxPlies = 400;
+    double elo0 = 0, elo1 = 10, alpha = 0.05, beta = 0.05;
+    ostream* stream = nullptr;
+    mutex lock;
+    atomic<int> next{0};
+    atomic<bool> stop{false};
+    // of the first engine.
+    int wins = 0, draws = 0, losses = 0;
+
+    /*
+     * Plays game number game and returns the score of the first engine.
+     */
+    double play(int game, vector<uint8_t>& packed) {
+      Board board{PositionView(openings[game / 2 % openings.size()].data())};
+      Engine engines[2] = {Engine(first), Engine(second)};
+      // the first engine moves first in the even games.
+      Color firstColor = game % 2 == 0 ? board.getCurrent() : board.getCurrent() == Color::W ? Color::B : Color::W;
+      double score = 0.5;
+      for (int ply = 0; ply < maxPlies && board.legalMoves(nullptr); ply++) {
+        Color mover = board.getCurrent();
+        Move m = engines[mover == firstColor ? 0 : 1].choose(board);
+        Result r = board.move(Board::squareName(m.getFrom()), Board::squareName(m.getTo()));
+        if (r.promotion) {
+          r = board.promote(Piece::Q);
+        }
+        if (r.checkmate) {
+          score = mover == firstColor ? 1 : 0;
+          break;
+        }
+        if (r.draw != Draw::None) {
+          break;
+        }
       }
-      if (from.getColumn() + 1 < 8) {
-        Position cap = Position(from.getRow() + add, from.getColumn() + 1);
-	BPiece * c = board->get(cap);
-	if (c != nullptr && c->getColor() != board->getCurrent() && to.getRow() == cap.getRow() && to.getColumn() == cap.getColumn()) {
-          return MoveResult(true, to.getRow() == 0 || to.getRow() == 7, false, false, false, false);
-	}
-	// enpassant
-	if (c == nullptr && to.getRow() == cap.getRow() && to.getColumn() == cap.getColumn()) {
-	  Position enPassant = board->getEnpassant();
-	  return MoveResult(enPassant.getRow() != -1 && enPassant.getRow() == from.getRow() && enPassant.getColumn() == from.getColumn() + 1, false, false, true, false, false);
-	} 
+      board.packGame(packed);
+      return score;
+    }
+
+    void work() {
+      while (!stop) {
+        int game = next++;
+        if (game >= games) {
+          break;
+        }
+        vector<uint8_t> packed;
+        double score = play(game, packed);
+        lock_guard<mutex> guard(lock);
+        if (stream != nullptr) {
+          stream->write(reinterpret_cast<const char*>(packed.data()), packed.size());
+        }
+        wins += score == 1;
+        draws += score == 0.5;
+        losses += score == 0;
+        if (getSprtResult() != 0) {
+          stop = true;
+        }
       }
-      
-      return MoveResult(false, false, false, false, false, false);
     }
-};
 
-class BishopMoveCalculator : public MoveCalculator {
-  public:
-    MoveResult canMove(Board* board, Position& from, Position& to) override {
-      for (int i = -1; i <= 1; i += 2) {
-        for (int j = -1; j <= 1; j += 2) {
-          for (int r = from.getRow() + i, c = from.getColumn() + j; r >= 0 && r < 8 && c >= 0 && c < 8; r += i, c += j) {
-            Position p = Position(r, c);
-	    BPiece * bp = board->get(p);
-            if (r == to.getRow() && c == to.getColumn() && (bp == nullptr || bp->getColor() != board->getCurrent())) {
-	      return MoveResult(true, false, false, false, false, false);	
-	    }
-	    if (r == to.getRow() && c == to.getColumn()) {
-	      return MoveResult(false, false, false, false, false, false);
-	    }
-	    if (bp != nullptr) {
-	      break;
-	    }
-          }
-	}
+    static double eloOf(double score) {
+      if (score == 0.5) {
+        return 0;
       }
+      score = min(max(score, 1e-6), 1 - 1e-6);
+      return -400 * log10(1 / score - 1);
+    }
 
-      return MoveResult(false, false, false, false, false, false);
+    static double scoreOf(double elo) {
+      return 1 / (1 + pow(10, -elo / 400));
     }
-};
 
-class HorseMoveCalculator : public MoveCalculator {
-  public:
-    MoveResult canMove(Board* board, Position& from, Position& to) override {
-      int moves[8][2] = {{1, 2}, {2, 1}, {-1, 2}, {2, -1}, {-2, 1}, {1, -2}, {-2, -1}, {-1, -2}};
-      int len = end(moves) - begin(moves); 
-      for (int m = 0; m < len; m++) {
-	 int r = moves[m][0] + from.getRow();
-	 int c = moves[m][1] + from.getColumn();
-	 if (r >= 0 && r < 8 && c >= 0 && c < 8 && r == to.getRow() && c == to.getColumn()) {
-	   BPiece * bp = board->get(to);
-	   if (bp == nullptr || bp->getColor() != board->getCurrent()) {
-	     return MoveResult(true, false, false, false, false, false);
-	   }
-	   return MoveResult(false, false, false, false, false, false);
-	 }
-
-      }
-       
-      return MoveResult(false, false, false, false, false, false);
+    double getScore() {
+      return (wins + draws / 2.0) / getGames();
+    }
+
+    /*
+     * Variance of the score of one game.
+     */
+    double getVariance() {
+      double s = getScore();
+      return (wins * (1 - s) * (1 - s) + draws * (0.5 - s) * (0.5 - s) + losses * s * s) / getGames();
     }
-};
 
-class KingMoveCalculator : public MoveCalculator {
   public:
-    MoveResult canMove(Board* board, Position& from, Position& to) override {
-      int rowDiff = abs(from.getRow() - to.getRow());
-      int colDiff = abs(from.getColumn() - to.getColumn());
-      BPiece * bp = board->get(to);
-      if (rowDiff <= 1 && colDiff <= 1 && (bp == nullptr || bp->getColor() != board->getCurrent())) {
-        return MoveResult(true, false, false, false, false, false);
-      } else if (rowDiff <= 1 && colDiff <= 1) {
-	return MoveResult(false, false, false, false, false, false);
+    SelfPlay(EngineConfig first, EngineConfig second, vector<string> fens, int games) {
+      this->first = first;
+      this->second = second;
+      this->games = games;
+      for (string& fen : fens) {
+        array<uint8_t, packedPositionSize> p;
+        packFen(fen, p.data());
+        openings.push_back(p);
       }
-
-      if (board->getCurrent() == Color::W && to.getRow() == 7 && to.getColumn() == 6 && board->canExecuteSmallCastle()) {
-	      return MoveResult(true, false, false, false, true, false);
+      if (openings.empty()) {
+        throw logic_error("No openings!");
       }
+    }
 
-      if (board->getCurrent() == Color::W && to.getRow() == 7 && to.getColumn() == 2 && board->canExecuteBigCastle()) {
-        return MoveResult(true, false, false, false, false, true);
-      }
+    void setStream(ostream* stream) {
+      this->stream = stream;
+    }
+    void setMaxPlies(int maxPlies) {
+      this->maxPlies = maxPlies;
+    }
+    void setSprt(double elo0, double elo1, double alpha, double beta) {
+      this->elo0 = elo0;
+      this->elo1 = elo1;
+      this->alpha = alpha;
+      this->beta = beta;
+    }
 
-      if (board->getCurrent() == Color::B && to.getRow() == 0 && to.getColumn() == 6 && board->canExecuteSmallCastle()) {
-        return MoveResult(true, false, false, false, true, false);
+    void run(int threads) {
+      vector<thread> workers;
+      for (int i = 0; i < threads; i++) {
+        workers.push_back(thread(&SelfPlay::work, this));
       }
-
-      if (board->getCurrent() == Color::B && to.getRow() == 0 && to.getColumn() == 2 && board->canExecuteBigCastle()) {
-        return MoveResult(true, false, false, false, false, true);
+      for (thread& t : workers) {
+        t.join();
       }
-      return MoveResult(false, false, false, false, false, false);
     }
-};
 
+    int getGames() {
+      return wins + draws + losses;
+    }
+    int getWins() {
+      return wins;
+    }
+    int getDraws() {
+      return draws;
+    }
+    int getLosses() {
+      return losses;
+    }
 
-class RookMoveCalculator : public MoveCalculator {
-  public:
-    MoveResult canMove(Board* board, Position& from, Position& to) override {
-      if (to.getRow() != from.getRow() && to.getColumn() != from.getColumn()) {
-        return MoveResult(false, false, false, false, false, false);
+    /*
+     * Elo of the first engine over the second, and half the width of its
+     * 95% confidence interval.
+     */
+    double getElo() {
+      return getGames() == 0 ? 0 : eloOf(getScore());
+    }
+    double getEloError() {
+      if (getGames() == 0) {
+        return 0;
       }
-      int addRow = 0;
-      if (to.getRow() > from.getRow()) {
-        addRow = 1;
-      } else if (to.getRow() < from.getRow()) {
-	addRow = -1;
-      }
-      int addCol = 0;
-      if (to.getColumn() > from.getColumn()) {
-        addCol = 1;
-      } else if (to.getColumn() < from.getColumn()) {
-        addCol = -1;
-      }
-      for (int r = from.getRow() + addRow, c = from.getColumn() + addCol; r >= 0 && r < 8 && c >= 0 && c < 8; r += addRow, c += addCol) {
-        Position p = Position(r, c);
-	BPiece * bp = board->get(p);
-	if (r == to.getRow() && c == to.getColumn()) {
-	   bool canMove = bp == nullptr || bp->getColor() != board->getCurrent();
-	   return MoveResult(canMove, false, false, false, false, false);  
-	}
-	if (bp != nullptr) {
-	  return MoveResult(false, false, false, false, false, false);
-	}
+      double margin = 1.96 * sqrt(getVariance() / getGames());
+      return (eloOf(getScore() + margin) - eloOf(getScore() - margin)) / 2;
+    }
+
+    /*
+     * Log likelihood ratio of elo1 against elo0, with the game scores
+     * taken as normally distributed around the expected score.
+     */
+    double getLlr() {
+      double variance = getGames() == 0 ? 0 : getVariance();
+      if (variance == 0) {
+        return 0;
       }
-      return MoveResult(false, false, false, false, false, false);
+      double s0 = scoreOf(elo0), s1 = scoreOf(elo1);
+      return getGames() * (s1 - s0) * (2 * getScore() - s0 - s1) / (2 * variance);
     }
-};
 
-class QueenMoveCalculator : public MoveCalculator {
-  public:
-    MoveResult canMove(Board* board, Position& from, Position& to) override {
-      BishopMoveCalculator b;
-      MoveResult mr = b.canMove(board, from, to);
-      if (mr.canMove) {
-        return mr;
+    /*
+     * 1 when the test accepted elo1, -1 when it accepted elo0 and 0 while
+     * it could not tell. The variance of a handful of games says too
+     * little to decide on, so the test waits for sprtMinGames.
+     */
+    int getSprtResult() {
+      if (getGames() < sprtMinGames) {
+        return 0;
       }
-      RookMoveCalculator r;
-      return r.canMove(board, from, to);
+      double llr = getLlr();
+      return llr >= log((1 - beta) / alpha) ? 1 : llr <= log(beta / (1 - alpha)) ? -1 : 0;
     }
 };
 
-void Board::init() {
-      calculators[Piece::P] = new PawnMoveCalculator;
-      calculators[Piece::B] = new BishopMoveCalculator;
-      calculators[Piece::H] = new HorseMoveCalculator;
-      calculators[Piece::R] = new RookMoveCalculator;
-      calculators[Piece::Q] = new QueenMoveCalculator;
-      calculators[Piece::K] = new KingMoveCalculator;
-}
-
+/*
+ * The calculators are timed here rather than in their canMove, so the
+ * queen's use of the bishop and rook calculators counts once.
+ */
 MoveResult BPiece::canMove(Board* b, Position& from, Position& to) {
+  INSTRUMENT(static_cast<Operation>(static_cast<int>(Operation::KingMoveCalculator) + static_cast<int>(this->piece)));
   return b->canMovePiece(this->piece, from, to);
 }
 
-int main() {
-
+/*
+ * chess                        plays a game on the terminal.
+ * chess solve <n> [<fen>]     looks for a mate in at most n moves of the
+ *                              player to move in fen, or in every FEN read
+ *                              from the terminal, and prints the line.
+ * chess selfplay [--first <settings>] [--second <settings>] [--openings <file>]
+ *     [--games <n>] [--threads <n>] [--max-plies <n>] [--out <file>]
+ *     [--elo0 <e>] [--elo1 <e>] [--alpha <a>] [--beta <b>]
+ *                              plays two engine configurations against
+ *                              each other on worker threads, writes the
+ *                              packed games to file and prints the Elo
+ *                              of the first one and the SPRT result.
+ * chess bench [--out <file>] [--compare <baseline>] [--threshold <pct>] [--repetitions <n>]
+ *                              times the referee over a fixed corpus and
+ *                              writes the result as JSON to file or the
+ *                              terminal. With a baseline it exits with 1
+ *                              when the fastest round of an operation got
+ *                              slower by more than pct percent, 15 by
+ *                              default, over n rounds, 50 by default.
+ *                              Runs of the same binary differ by up to
+ *                              about 14% here, so lower is noise.
+ * chess perft [<depth> <fen>]  counts the leaf nodes of the legal move
+ *                              tree of fen to depth, or runs the reference
+ *                              suite and exits with 1 on a wrong count.
+ * Built with -DCHESS_INSTRUMENT, answering stats to From? prints the
+ * instrumentation counters as JSON.
+ */
+int main(int argc, char** argv) {
+
+    if (argc >= 2 && string(argv[1]) == "bench") {
+      string out, baseline;
+      double threshold = 15;
+      int repetitions = 50;
+      for (int i = 2; i + 1 < argc; i += 2) {
+        string option = argv[i];
+        if (option == "--out") {
+          out = argv[i + 1];
+        } else if (option == "--compare") {
+          baseline = argv[i + 1];
+        } else if (option == "--threshold") {
+          threshold = atof(argv[i + 1]);
+        } else if (option == "--repetitions") {
+          repetitions = atoi(argv[i + 1]);
+        }
+      }
+      Benchmark bench;
+      bench.run(repetitions);
+      // with --compare alone only the comparison is printed.
+      if (!out.empty()) {
+        ofstream f(out);
+        bench.writeJson(f);
+      } else if (baseline.empty()) {
+        bench.writeJson(cout);
+      }
+      if (!baseline.empty()) {
+        ifstream f(baseline);
+        if (!f) {
+          cout << "Cannot read " << baseline << "!" << '\n';
+          return 2;
+        }
+        map<string, double> before = Benchmark::readJson(f);
+        return bench.compare(before, threshold, cout) ? 0 : 1;
+      }
+      return 0;
+    }
+    if ((argc == 2 || argc == 4) && string(argv[1]) == "perft") {
+      try {
+        uint8_t position[packedPositionSize];
+        if (argc == 4) {
+          packFen(argv[3], position);
+          cout << perft(position, atoi(argv[2])) << '\n';
+          return 0;
+        }
+        bool ok = true;
+        for (const PerftCase& c : perftSuite) {
+          packFen(c.fen, position);
+          long nodes = perft(position, c.depth);
+          ok = ok && nodes == c.nodes;
+          cout << c.fen << " depth " << c.depth << ": " << nodes << (nodes == c.nodes ? "" : " WRONG, expected " + to_string(c.nodes)) << '\n';
+        }
+        return ok ? 0 : 1;
+      } catch (exception& e) {
+        cout << e.what() << '\n';
+        return 2;
+      }
+    }
+    if ((argc == 3 || argc == 4) && string(argv[1]) == "solve") {
+      int moves = atoi(argv[2]);
+      MateSolver solver;
+      vector<string> fens;
+      string fen;
+      if (argc == 4) {
+        fens.push_back(argv[3]);
+      }
+      while (argc == 3 && getline(cin, fen)) {
+        fens.push_back(fen);
+      }
+      for (string& fen : fens) {
+        uint8_t position[packedPositionSize];
+        try {
+          packFen(fen, position);
+          MateSolution s = solver.solve(position, moves);
+          if (s.mate) {
+            cout << "Mate in " << s.moves << ":";
+            for (string& m : s.line) {
+              cout << ' ' << m;
+            }
+          } else if (s.complete) {
+            cout << "No mate in " << moves;
+          } else {
+            cout << "Unknown";
+          }
+          cout << " (" << s.nodes << " nodes)" << '\n';
+        } catch (exception& e) {
+          cout << e.what() << '\n';
+        }
+      }
+      return 0;
+    }
+    if (argc >= 2 && string(argv[1]) == "selfplay") {
+      EngineConfig first("nodes=2000"), second("nodes=2000");
+      vector<string> fens(begin(selfPlayOpenings), end(selfPlayOpenings));
+      int games = 1000, threads = max(1u, thread::hardware_concurrency()), maxPlies = 400;
+      double elo0 = 0, elo1 = 10, alpha = 0.05, beta = 0.05;
+      string out;
+      try {
+        for (int i = 2; i + 1 < argc; i += 2) {
+          string option = argv[i], value = argv[i + 1];
+          if (option == "--first") {
+            first = EngineConfig(value);
+          } else if (option == "--second") {
+            second = EngineConfig(value);
+          } else if (option == "--openings") {
+            ifstream f(value);
+            if (!f) {
+              throw logic_error("Cannot read " + value + "!");
+            }
+            fens.clear();
+            string fen;
+            while (getline(f, fen)) {
+              if (!fen.empty()) {
+                fens.push_back(fen);
+              }
+            }
+          } else if (option == "--games") {
+            games = atoi(value.c_str());
+          } else if (option == "--threads") {
+            threads = max(1, atoi(value.c_str()));
+          } else if (option == "--max-plies") {
+            maxPlies = atoi(value.c_str());
+          } else if (option == "--out") {
+            out = value;
+          } else if (option == "--elo0") {
+            elo0 = atof(value.c_str());
+          } else if (option == "--elo1") {
+            elo1 = atof(value.c_str());
+          } else if (option == "--alpha") {
+            alpha = atof(value.c_str());
+          } else if (option == "--beta") {
+            beta = atof(value.c_str());
+          } else {
+            throw logic_error("Unknown option " + option + "!");
+          }
+        }
+        SelfPlay match(first, second, fens, games);
+        match.setMaxPlies(maxPlies);
+        match.setSprt(elo0, elo1, alpha, beta);
+        ofstream stream;
+        if (!out.empty()) {
+          stream.open(out, ios::binary);
+          if (!stream) {
+            throw logic_error("Cannot write " + out + "!");
+          }
+          match.setStream(&stream);
+        }
+        match.run(threads);
+        int sprt = match.getSprtResult();
+        cout << "Games: " << match.getGames() << ", first +" << match.getWins() << " =" << match.getDraws() << " -" << match.getLosses() << '\n';
+        cout << "Elo: " << match.getElo() << " +/- " << match.getEloError() << '\n';
+        cout << "SPRT [" << elo0 << ", " << elo1 << "]: LLR " << match.getLlr() << " (" << log(beta / (1 - alpha)) << ", " << log((1 - beta) / alpha) << "), "
+             << (sprt == 1 ? "H1 accepted" : sprt == -1 ? "H0 accepted" : "inconclusive") << '\n';
+      } catch (exception& e) {
+        cout << e.what() << '\n';
+        return 2;
+      }
+      return 0;
+    }
     Board b;
     b.print();
     string from;
@@ -865,6 +3865,12 @@ int main() {
     while (true) {
       cout << "From?" << '\n';
       cin >> from;
+#ifdef CHESS_INSTRUMENT
+      if (from == "stats") {
+        Instrumentation::dumpJson(cout);
+        continue;
+      }
+#endif
       cout << "To?" << '\n';
       cin >> to;
       try {
@@ -892,11 +3898,14 @@ int main() {
 	  cout << "Current is in check!" << '\n';
 	  cout << "Is checkmate: " << r.checkmate << '\n';
 	}
+	if (r.draw != Draw::None) {
+	  cout << "Draw!" << '\n';
+	}
       } catch (exception& e) {
 	cout << e.what() << '\n';
       }      
       b.print();
-      if (r.checkmate) {
+      if (r.checkmate || r.draw != Draw::None) {
         break;
       }
     }